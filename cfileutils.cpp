@@ -10,6 +10,7 @@
 * Changelog:
 *   - 20120530 Doc in English
 *   - 20120531 Renamed as cfileutils.cpp to build correctly with Makefile
+*   - 20261017 file_map() / file_unmap()
 *
 *************************************************************/
 
@@ -17,6 +18,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -166,7 +168,7 @@ int copyFile(char *origin, char *destination)
   char buffer[512];
 
   int result=0;
-  size_t bytes;
+  ssize_t bytes;
 
   forigin=open(origin, O_RDONLY);
   if (forigin<0)
@@ -252,6 +254,48 @@ int file_get_contents(char **data, char *fileName, int freeNotNull)
   return 0;
 }
 
+long long file_map(const char **data, const char *fileName)
+{
+  struct stat sinfo;
+  void *addr;
+  int fd;
+
+  *data=NULL;
+  fd=open(fileName, O_RDONLY);
+  if (fd<0)
+    return -1;
+
+  if (fstat(fd, &sinfo)<0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  if (sinfo.st_size==0)		/* mmap() refuses zero-length mappings */
+    {
+      close(fd);
+      return 0;
+    }
+
+  addr=mmap(NULL, sinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);			/* The mapping keeps its own reference */
+  if (addr==MAP_FAILED)
+    return -1;
+
+  madvise(addr, sinfo.st_size, MADV_SEQUENTIAL);
+  *data=(const char*)addr;
+
+  return sinfo.st_size;
+}
+
+int file_unmap(const char *data, long long size)
+{
+  if ( (data==NULL) || (size<=0) )
+    return 0;
+
+  return munmap((void*)data, size);
+}
+
 int createDir (const char *dirName, mode_t mode)
 {
   return mkdir (dirName, mode);
@@ -109,6 +109,28 @@ int removeFile(char *name);
 
 int file_get_contents(char **data, char *fileName, int freeNotNull);
 
+/**
+ * Maps a whole file read-only into memory, so it can be read without
+ * copying it. Use file_unmap() to release it.
+ *
+ * @param data     Where to store the address of the mapped data. It will
+ *                 be NULL for empty files.
+ * @param fileName File name
+ *
+ * @return mapped size in bytes (0 for empty files), -1 on error
+ */
+long long file_map(const char **data, const char *fileName);
+
+/**
+ * Releases a mapping obtained with file_map()
+ *
+ * @param data Mapped address
+ * @param size Mapped size
+ *
+ * @return 0 on success, -1 on error
+ */
+int file_unmap(const char *data, long long size);
+
 /* Necesaria ¿? */
 int createDir (const char *dirName, mode_t mode);
 #endif /* _CFILEUTILS_H */
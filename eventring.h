@@ -0,0 +1,75 @@
+/* @(#)eventring.h
+ */
+
+#ifndef _EVENTRING_H
+#define _EVENTRING_H 1
+
+#include <atomic>
+#include <stddef.h>
+
+/**
+ * Lock-free single producer / single consumer ring buffer. One thread
+ * may push() while another one pop()s, without locks or allocations.
+ *
+ * @param T element type
+ * @param N capacity, must be a power of two
+ */
+template <typename T, size_t N>
+class GEventRing
+{
+public:
+  GEventRing(): head(0), tail(0)
+  {
+    static_assert( (N&(N-1))==0, "GEventRing size must be a power of two");
+  }
+
+  /**
+   * Adds an element. Producer thread only.
+   *
+   * @param item element to add
+   *
+   * @return false if the ring is full and the element was not added
+   */
+  bool push(const T &item)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+
+    if (t-head.load(std::memory_order_acquire)==N)
+      return false;
+
+    items[t&(N-1)] = item;
+    tail.store(t+1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Takes the oldest element. Consumer thread only.
+   *
+   * @param item where to store the element
+   *
+   * @return false if the ring is empty
+   */
+  bool pop(T &item)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+
+    if (h==tail.load(std::memory_order_acquire))
+      return false;
+
+    item = items[h&(N-1)];
+    head.store(h+1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return head.load(std::memory_order_acquire)==tail.load(std::memory_order_acquire);
+  }
+
+private:
+  T items[N];
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+};
+
+#endif /* _EVENTRING_H */
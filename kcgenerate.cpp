@@ -0,0 +1,234 @@
+/**
+*************************************************************
+* @file kcgenerate.cpp
+* @brief Synthetic log generator
+*
+* Writes deterministic, realistic looking logs to test and
+* benchmark the analyzer with any amount of data.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <math.h>
+#include <stdlib.h>
+#include <charconv>
+#include <fstream>
+#include <vector>
+#include <sys/stat.h>
+#include "cfileutils.h"
+#include "kcsegment.h"
+#include "kcgenerate.h"
+
+using namespace std;
+
+/* Most typed keys first, so Zipf ranks make some sense */
+static const char *generatorKeys[] = {
+  "space", "e", "t", "a", "o", "i", "n", "s", "r", "h", "l", "d", "BackSpace",
+  "c", "u", "m", "Return", "f", "p", "g", "w", "y", "b", "comma", "period",
+  "v", "k", "Shift_L", "Control_L", "Tab", "x", "j", "q", "z", "Up", "Down",
+  "Left", "Right", "parenleft", "parenright", "semicolon", "colon", "minus",
+  "equal", "slash", "quotedbl", "apostrophe", "underscore", "Shift_R",
+  "Alt_L", "Escape", "braceleft", "braceright", "bracketleft", "bracketright",
+  "1", "2", "0", "3", "4", "5", "9", "8", "6", "7", "Delete", "Home", "End",
+  "Prior", "Next", "less", "greater", "asterisk", "plus", "numbersign",
+  "ampersand", "bar", "backslash", "dollar", "exclam", "question", "at",
+  "percent", "asciicircum", "asciitilde", "grave", "Super_L", "F1", "F2",
+  "F5", "F11", "Insert", "Caps_Lock", "Menu"
+};
+
+#define GENERATOR_KEYS (sizeof(generatorKeys)/sizeof(generatorKeys[0]))
+
+/* splitmix64, small and good enough to be deterministic everywhere */
+class KCRandom
+{
+public:
+  KCRandom(uint64_t seed): state(seed)
+  {
+  }
+
+  uint64_t next()
+  {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+    return z ^ (z>>31);
+  }
+
+  /* [0, 1) */
+  double uniform()
+  {
+    return (next()>>11) * (1.0/9007199254740992.0);
+  }
+
+  /* Exponential with the given mean, at least 1 */
+  unsigned exponential(unsigned mean)
+  {
+    double v = -log(1.0-uniform()) * mean;
+    return (v<1)?1:(unsigned)v;
+  }
+
+private:
+  uint64_t state;
+};
+
+/* Writes blocks into segments, rotating them like the recorder does */
+class KCGeneratorOutput
+{
+public:
+  KCGeneratorOutput(const KCGenerateOptions &options): written(0), segments(0), failed(false), options(options)
+  {
+  }
+
+  ~KCGeneratorOutput()
+  {
+    close();
+  }
+
+  void block(const KCBlock &block)
+  {
+    if ( (name.empty()) || ((long long)data.size()>options.segmentBytes) )
+      open(block.save);
+
+    size_t before = data.size();
+    if (options.binary)
+      {
+	KCBlock named = block;
+	for (unsigned i=0; i<named.keys.size(); ++i)
+	  named.keys[i].id = writer.keyId(generatorKeys[named.keys[i].id]);
+	data+=writer.block(named);
+      }
+    else
+      {
+	number("9 Save: ", block.save);
+	for (unsigned i=0; i<block.typing.size(); ++i)
+	  number((block.typing[i].first==7)?"7 Stop typing: ":"8 Start typing: ", block.typing[i].second);
+	for (unsigned i=0; i<block.keys.size(); ++i)
+	  {
+	    data+="1 Press (";
+	    data+=generatorKeys[block.keys[i].id];
+	    number(") : ", block.keys[i].presses);
+	  }
+      }
+    written+=data.size()-before;
+  }
+
+  void close()
+  {
+    if (name.empty())
+      return;
+
+    ofstream of(name.c_str(), ios::trunc | ios::binary);
+    if (of.is_open())
+      {
+	of << data;
+	of.close();
+      }
+    if (of.fail())
+      failed = true;
+    name.clear();
+    data.clear();
+  }
+
+  long long written;
+  long segments;
+  bool failed;
+
+private:
+  const KCGenerateOptions &options;
+  KCSegmentWriter writer;
+  string name;
+  string data;
+
+  void open(time_t when)
+  {
+    char *path = NULL;
+
+    close();
+    makePath(&path, options.dir.c_str(), (to_string(when)+((options.binary)?".kcb":".log")).c_str());
+    name = path;
+    free(path);
+
+    if (options.binary)
+      {
+	writer = KCSegmentWriter();
+	data = writer.header(when);
+      }
+    segments++;
+  }
+
+  void number(const char *prefix, long long value)
+  {
+    char digits[24];
+    to_chars_result res = to_chars(digits, digits+sizeof(digits), value);
+
+    data+=prefix;
+    data.append(digits, res.ptr-digits);
+    data+='\n';
+  }
+};
+
+long generateLogs(const KCGenerateOptions &options)
+{
+  KCRandom random(options.seed);
+  KCGeneratorOutput output(options);
+  vector<double> weights(GENERATOR_KEYS);
+  vector<pair<int, time_t> > typing;
+  KCBlock block;
+  double total = 0;
+  time_t t = options.start;
+
+  if ( (directory_exists(options.dir.c_str())==0) && (createDir(options.dir.c_str(), 0744)<0) )
+    return -1;
+  if (directory_exists(options.dir.c_str())!=1)
+    return -1;
+
+  for (unsigned k=0; k<GENERATOR_KEYS; ++k)
+    {
+      weights[k] = 1.0/pow(k+1, options.zipf);
+      total+=weights[k];
+    }
+  for (unsigned k=0; k<GENERATOR_KEYS; ++k)
+    weights[k]/=total;
+
+  while (output.written<options.bytes)
+    {
+      time_t burstStart = t;
+      time_t burstEnd = t+random.exponential(options.burstMean);
+
+      typing.push_back(make_pair(8, burstStart));
+      for (time_t w=burstStart; w<burstEnd; )
+	{
+	  time_t windowEnd = min(w+(time_t)options.storeTime, burstEnd);
+	  double presses = options.keysPerMinute*(windowEnd-w)/60.0;
+
+	  block.clear();
+	  block.hasSave = true;
+	  block.save = windowEnd;
+	  block.typing.swap(typing);
+	  for (unsigned k=0; k<GENERATOR_KEYS; ++k)
+	    {
+	      // Expected presses, randomly rounded
+	      unsigned count = (unsigned)(presses*weights[k]+random.uniform());
+	      if (count)
+		block.keys.push_back({k, count});
+	    }
+	  output.block(block);
+	  w = windowEnd;
+	}
+
+      // Nothing typed for a while: the recorder closes the burst
+      block.clear();
+      block.hasSave = true;
+      block.save = burstEnd+options.maxIdleTime+1;
+      block.typing.push_back(make_pair(7, burstEnd));
+      output.block(block);
+
+      t = block.save+random.exponential(options.idleMean);
+    }
+  output.close();
+
+  return (output.failed)?-2:output.segments;
+}
@@ -0,0 +1,49 @@
+/* @(#)kcgenerate.h
+ */
+
+#ifndef _KCGENERATE_H
+#define _KCGENERATE_H 1
+
+#include <string>
+#include <ctime>
+#include <stdint.h>
+
+/**
+ * What the synthetic log generator must write. The same options (and
+ * seed) always produce the same logs.
+ */
+struct KCGenerateOptions
+{
+  std::string dir;		/* Where to write segments */
+  long long bytes;		/* Total size to write */
+  long long segmentBytes;	/* Rotate segments at this size */
+  uint64_t seed;
+  double zipf;			/* Key popularity skew, 0 is uniform */
+  unsigned keysPerMinute;	/* Typing speed while in a burst */
+  unsigned burstMean;		/* Mean typing burst, in seconds */
+  unsigned idleMean;		/* Mean idle time between bursts, in seconds */
+  unsigned storeTime;		/* Seconds between saves */
+  unsigned maxIdleTime;		/* Idle time closing a burst */
+  time_t start;			/* Time of the first event */
+  bool binary;			/* Binary segments instead of text */
+
+  KCGenerateOptions(): bytes(10*1024*1024), segmentBytes(100000), seed(1), zipf(1.1),
+		       keysPerMinute(240), burstMean(300), idleMean(900), storeTime(120),
+		       maxIdleTime(15), start(1577836800), binary(false)
+  {
+  }
+};
+
+/**
+ * Writes synthetic logs in the recorder's format: typing bursts and
+ * idle times of random (exponential) length, a save every storeTime
+ * seconds while typing and keys following a Zipf distribution.
+ *
+ * @param options what to generate
+ *
+ * @return number of segments written, -1 if the directory can't be
+ *         created, -2 if a segment can't be written
+ */
+long generateLogs(const KCGenerateOptions &options);
+
+#endif /* _KCGENERATE_H */
@@ -0,0 +1,567 @@
+/**
+*************************************************************
+* @file kcinput.cpp
+* @brief Where key presses come from
+*
+* Input sources for the recorder: every X client (XRecord),
+* capture files, and kernel input devices (evdev).
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <iostream>
+#include <thread>
+#include <string_view>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/record.h>
+#include "cfileutils.h"
+#include "kcscan.h"
+#include "kcreport.h"
+#include "kcstats.h"
+#include "kcinput.h"
+
+#define EXIT_ON_ESCAPE 0
+#define EVDEV_BATCH 64		/* Events read at once */
+
+using namespace std;
+
+static int Exit_signal = 0;
+
+typedef struct
+{
+  int Status1, Status2, x, y, mmoved, doit;
+  unsigned int QuitKey;
+  Display *LocalDpy, *RecDpy;
+  XRecordContext rc;
+  GKeymap *keymap;
+  GKeySink *sink;
+} Priv;
+
+void GKeymap::load(Display *dpy)
+{
+  int minKeycode, maxKeycode, perKeycode;
+  KeySym *keysyms;
+  shared_ptr<GKeyNames> names = make_shared<GKeyNames>();
+
+  names->fill("NoSymbol");
+
+  XDisplayKeycodes(dpy, &minKeycode, &maxKeycode);
+  keysyms = XGetKeyboardMapping(dpy, minKeycode, maxKeycode-minKeycode+1, &perKeycode);
+  if (keysyms==NULL)
+    return;
+
+  for (int k=minKeycode; k<=maxKeycode; ++k)
+    {
+      const char *name = XKeysymToString(keysyms[(k-minKeycode)*perKeycode]);
+      if (name!=NULL)
+	(*names)[k] = name;
+    }
+
+  XFree(keysyms);
+  atomic_store(&table, shared_ptr<const GKeyNames>(names));
+  loads++;
+}
+
+/* Reads a signal arrived to signalFd. SIGUSR1 writes the recorder
+   stats to stderr, and we go on. Returns true if we must exit */
+static bool exitSignal(int signalFd, const GKeySink *sink)
+{
+  struct signalfd_siginfo sig;
+
+  if (read(signalFd, &sig, sizeof(sig))!=sizeof(sig))
+    return false;
+  if (sig.ssi_signo!=SIGUSR1)
+    return true;
+
+  KCReport report(REPORT_TSV, 2);
+  recorderStats.write(report, sink->droppedEvents());
+  return false;
+}
+
+/* Sleeps unless an exit signal arrives first. true if it did */
+static bool waitSignal(int signalFd, const GKeySink *sink, double seconds)
+{
+  struct pollfd fd;
+  struct timespec timeout;
+
+  fd.fd = signalFd;
+  fd.events = POLLIN;
+  timeout.tv_sec = (time_t)seconds;
+  timeout.tv_nsec = (long)((seconds-timeout.tv_sec)*1e9);
+  if (ppoll(&fd, 1, &timeout, NULL)<=0)
+    return false;
+
+  return exitSignal(signalFd, sink);
+}
+
+void GInputSource::waitQueue(GKeySink *sink, int action, unsigned char keycode, time_t when, uint32_t ms)
+{
+  recorderStats.captured++;
+  while (!sink->offerKey(action, keycode, when, ms))
+    {
+      ++waits;
+      this_thread::yield();
+    }
+}
+
+static void eventCallback(XPointer priv, XRecordInterceptData *d)
+{
+  Priv *p=(Priv *) priv;
+  unsigned int type, detail;
+  unsigned char *ud1, type1, detail1;
+  GLatencyTimer timer(recorderStats.capture);
+
+  if (d->category!=XRecordFromServer || p->doit==0)
+    recorderStats.skipped++;
+  else
+    {
+      ud1=(unsigned char *)d->data;
+
+      type1=ud1[0]&0x7F; type=type1;
+      detail1=ud1[1]; detail=detail1;
+
+      switch (type)
+	{
+	case KeyPress:
+	  p->sink->queueKey(0, detail, time(NULL), d->server_time);
+	  if ( (EXIT_ON_ESCAPE) && (p->keymap->name(detail)=="Escape") )
+	    p->doit=false;
+	  break;
+
+	case KeyRelease:
+	  // cout << "KeyRelease " << p->keymap->name(detail) << endl;
+	  break;
+	default:
+	  recorderStats.skipped++;	// Press event sometimes
+	}
+    }
+  XRecordFreeData(d);
+}
+
+static Display * localDisplay () {
+
+  // open the display
+  Display * D = XOpenDisplay ( 0 );
+
+  if ( ! D ) {
+    criticalError((string)": could not open display \""+(string)XDisplayName ( 0 )+"\", aborting.");
+  }
+
+  // return the display
+  return D;
+}
+
+static void eventLoop (Display * LocalDpy, int LocalScreen,
+		       Display * RecDpy, GKeymap &keymap, GKeySink *sink, int signalFd) {
+
+  Window       Root, rRoot, rChild;
+  XRecordContext rc;
+  XRecordRange *rr;
+  XRecordClientSpec rcs;
+  Priv         priv;
+  XEvent       ev;
+  struct pollfd fds[3];
+  int pending;
+  int rootx, rooty, winx, winy;
+  unsigned int mmask;
+  Bool ret;
+  Status sret;
+
+  // get the root window and set default target
+  Root = RootWindow ( LocalDpy, LocalScreen );
+
+  ret=XQueryPointer(LocalDpy, Root, &rRoot, &rChild, &rootx, &rooty, &winx, &winy, &mmask);
+  cerr << "XQueryPointer returned: " << ret << endl;
+  rr=XRecordAllocRange();
+  if (!rr)
+  {
+        cerr << "Could not alloc record range, aborting." << endl;
+        exit(EXIT_FAILURE);
+  }
+  rr->device_events.first=KeyPress;
+  rr->device_events.last=KeyRelease;
+  rcs=XRecordAllClients;
+  rc=XRecordCreateContext(RecDpy, 0, &rcs, 1, &rr, 1);
+  if (!rc)
+  {
+        cerr << "Could not create a record context, aborting." << endl;
+        exit(EXIT_FAILURE);
+  }
+  priv.x=rootx;
+  priv.y=rooty;
+  priv.mmoved=1;
+  priv.Status2=0;
+  priv.Status1=2;
+  priv.doit=1;
+  priv.LocalDpy=LocalDpy;
+  priv.RecDpy=RecDpy;
+  priv.rc=rc;
+  priv.keymap=&keymap;
+  priv.sink=sink;
+
+  if (!XRecordEnableContextAsync(RecDpy, rc, eventCallback, (XPointer) &priv))
+  {
+        cerr << "Could not enable the record context, aborting." << endl;
+        exit(EXIT_FAILURE);
+  }
+
+  fds[0].fd = ConnectionNumber(RecDpy);
+  fds[1].fd = ConnectionNumber(LocalDpy);
+  fds[2].fd = signalFd;
+  for (unsigned i=0; i<3; ++i)
+    fds[i].events = POLLIN;
+
+  // Sleep until the server sends something or we are asked to exit
+  while ((priv.doit) && (!Exit_signal) )
+    {
+      // What the server sent while we were away
+      if (ioctl(ConnectionNumber(RecDpy), FIONREAD, &pending)==0)
+	recorderStats.backlog.add(pending);
+      XRecordProcessReplies(RecDpy);
+
+      // Keyboard mapping changes are sent to every client
+      while (XPending(LocalDpy))
+	{
+	  XNextEvent(LocalDpy, &ev);
+	  if ( (ev.type==MappingNotify) && (ev.xmapping.request!=MappingPointer) )
+	    {
+	      XRefreshKeyboardMapping(&ev.xmapping);
+	      GLatencyTimer timer(recorderStats.keymap);
+	      keymap.load(LocalDpy);
+	    }
+	}
+
+      if ( (poll(fds, 3, -1)<0) && (errno!=EINTR) )
+	criticalError("Can't wait for X events");
+
+      if ( (fds[2].revents & POLLIN) && (exitSignal(signalFd, sink)) )
+	Exit_signal = 1;
+    }
+
+  sret=XRecordDisableContext(LocalDpy, rc);
+  if (!sret) cerr << "XRecordDisableContext failed!" << endl;
+  sret=XRecordFreeContext(LocalDpy, rc);
+  if (!sret) cerr << "XRecordFreeContext failed!" << endl;
+  XFree(rr);
+}
+
+GXRecordSource::GXRecordSource(): LocalDpy(NULL), RecDpy(NULL)
+{
+}
+
+GXRecordSource::~GXRecordSource()
+{
+  if (LocalDpy)
+    XCloseDisplay ( LocalDpy );
+}
+
+void GXRecordSource::open()
+{
+  int Major, Minor;
+
+  // open the local display twice
+  LocalDpy = localDisplay ();
+  RecDpy = localDisplay ();
+
+  if ( ! XRecordQueryVersion (RecDpy, &Major, &Minor ) )
+    {
+      // nope, extension not supported
+      XCloseDisplay ( RecDpy );
+      criticalError((string)"XRecord extension not supported on server \"" + (string) DisplayString(RecDpy) + (string)"\"");
+    }
+
+  // print some information
+  cerr << "XRecord for server \"" << DisplayString(RecDpy) << "\" is version "
+       << Major << "." << Minor << "." << endl << endl;;
+
+  GLatencyTimer timer(recorderStats.keymap);
+  keymap.load(LocalDpy);
+}
+
+void GXRecordSource::run(GKeySink *sink, int signalFd)
+{
+  eventLoop ( LocalDpy, DefaultScreen ( LocalDpy ), RecDpy, keymap, sink, signalFd);
+}
+
+static time_t parseTime(string_view str)
+{
+  time_t res = 0;
+
+  for (size_t i=0; (i<str.size()) && (str[i]>='0') && (str[i]<='9'); ++i)
+    res = res*10 + (str[i]-'0');
+  return res;
+}
+
+static double elapsed(const struct timespec &start, const struct timespec &now)
+{
+  return (now.tv_sec-start.tv_sec)+(now.tv_nsec-start.tv_nsec)/1e9;
+}
+
+GReplaySource::GReplaySource(const string &path, unsigned rate): path(path), rate(rate), data(NULL),
+								   size(0), seconds(0)
+{
+}
+
+GReplaySource::~GReplaySource()
+{
+  if (data)
+    file_unmap(data, size);
+}
+
+void GReplaySource::open()
+{
+  size = file_map(&data, path.c_str());
+  if (size<0)
+    criticalError("Can't read capture file "+path);
+
+  names.fill("NoSymbol");
+  keymap.assign(names);
+}
+
+void GReplaySource::run(GKeySink *sink, int signalFd)
+{
+  string_view buffer(data, size);
+  size_t pos = 0, eol;
+  unsigned long lineNumber = 0;
+  bool namesChanged = false;
+  struct timespec start, now;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (pos<buffer.size())
+    {
+      eol = buffer.find('\n', pos);
+      if (eol==string_view::npos)
+	eol = buffer.size();
+      string_view line = buffer.substr(pos, eol-pos);
+      pos = eol+1;
+      ++lineNumber;
+
+      if ( (line.empty()) || (line[0]=='#') )
+	continue;
+
+      if (line[0]=='K')
+	{
+	  size_t space = line.find(' ', 2);
+	  if (space==string_view::npos)
+	    criticalError("Wrong keymap line "+to_string(lineNumber)+" in "+path);
+	  names[parseInt(line.substr(2, space-2)) & 0xff] = string(line.substr(space+1));
+	  namesChanged = true;
+	  continue;
+	}
+
+      size_t first = line.find(' ');
+      size_t second = (first==string_view::npos)?first:line.find(' ', first+1);
+      if (second==string_view::npos)
+	criticalError("Wrong event line "+to_string(lineNumber)+" in "+path);
+      size_t third = line.find(' ', second+1);
+
+      // New names are used from the next event on, as with a MappingNotify
+      if (namesChanged)
+	{
+	  keymap.assign(names);
+	  namesChanged = false;
+	}
+
+      time_t when = parseTime(line.substr(0, first));
+      int action = parseInt(line.substr(first+1, second-first-1));
+      unsigned char keycode = parseInt(line.substr(second+1, third-second-1));
+      // Older captures have no milliseconds
+      uint32_t ms = (third==string_view::npos)?when*1000:parseTime(line.substr(third+1));
+
+      if (rate)
+	{
+	  // Wait for this event's turn, exit signals wake us up
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  double ahead = (double)queued/rate-elapsed(start, now);
+	  if ( (ahead>0) && (waitSignal(signalFd, sink, ahead)) )
+	    break;
+	  sink->queueKey(action, keycode, when, ms);
+	}
+      else
+	{
+	  // As fast as the writer can go, without losing anything
+	  waitQueue(sink, action, keycode, when, ms);
+	  if ( (queued%4096==0) && (waitSignal(signalFd, sink, 0)) )
+	    break;
+	}
+      ++queued;
+    }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = elapsed(start, now);
+}
+
+/* Keysym names of the keys of a US keyboard, by evdev key code, the
+   same names X gives them with its evdev keymap (X keycode = evdev code
+   + 8). Other keys are NoSymbol */
+static const pair<unsigned, const char*> evdevNames[] = {
+  { KEY_ESC, "Escape" }, { KEY_1, "1" }, { KEY_2, "2" }, { KEY_3, "3" }, { KEY_4, "4" },
+  { KEY_5, "5" }, { KEY_6, "6" }, { KEY_7, "7" }, { KEY_8, "8" }, { KEY_9, "9" }, { KEY_0, "0" },
+  { KEY_MINUS, "minus" }, { KEY_EQUAL, "equal" }, { KEY_BACKSPACE, "BackSpace" }, { KEY_TAB, "Tab" },
+  { KEY_Q, "q" }, { KEY_W, "w" }, { KEY_E, "e" }, { KEY_R, "r" }, { KEY_T, "t" }, { KEY_Y, "y" },
+  { KEY_U, "u" }, { KEY_I, "i" }, { KEY_O, "o" }, { KEY_P, "p" }, { KEY_LEFTBRACE, "bracketleft" },
+  { KEY_RIGHTBRACE, "bracketright" }, { KEY_ENTER, "Return" }, { KEY_LEFTCTRL, "Control_L" },
+  { KEY_A, "a" }, { KEY_S, "s" }, { KEY_D, "d" }, { KEY_F, "f" }, { KEY_G, "g" }, { KEY_H, "h" },
+  { KEY_J, "j" }, { KEY_K, "k" }, { KEY_L, "l" }, { KEY_SEMICOLON, "semicolon" },
+  { KEY_APOSTROPHE, "apostrophe" }, { KEY_GRAVE, "grave" }, { KEY_LEFTSHIFT, "Shift_L" },
+  { KEY_BACKSLASH, "backslash" }, { KEY_Z, "z" }, { KEY_X, "x" }, { KEY_C, "c" }, { KEY_V, "v" },
+  { KEY_B, "b" }, { KEY_N, "n" }, { KEY_M, "m" }, { KEY_COMMA, "comma" }, { KEY_DOT, "period" },
+  { KEY_SLASH, "slash" }, { KEY_RIGHTSHIFT, "Shift_R" }, { KEY_KPASTERISK, "KP_Multiply" },
+  { KEY_LEFTALT, "Alt_L" }, { KEY_SPACE, "space" }, { KEY_CAPSLOCK, "Caps_Lock" },
+  { KEY_F1, "F1" }, { KEY_F2, "F2" }, { KEY_F3, "F3" }, { KEY_F4, "F4" }, { KEY_F5, "F5" },
+  { KEY_F6, "F6" }, { KEY_F7, "F7" }, { KEY_F8, "F8" }, { KEY_F9, "F9" }, { KEY_F10, "F10" },
+  { KEY_NUMLOCK, "Num_Lock" }, { KEY_SCROLLLOCK, "Scroll_Lock" }, { KEY_KP7, "KP_Home" },
+  { KEY_KP8, "KP_Up" }, { KEY_KP9, "KP_Prior" }, { KEY_KPMINUS, "KP_Subtract" }, { KEY_KP4, "KP_Left" },
+  { KEY_KP5, "KP_Begin" }, { KEY_KP6, "KP_Right" }, { KEY_KPPLUS, "KP_Add" }, { KEY_KP1, "KP_End" },
+  { KEY_KP2, "KP_Down" }, { KEY_KP3, "KP_Next" }, { KEY_KP0, "KP_Insert" }, { KEY_KPDOT, "KP_Delete" },
+  { KEY_102ND, "less" }, { KEY_F11, "F11" }, { KEY_F12, "F12" }, { KEY_KPENTER, "KP_Enter" },
+  { KEY_RIGHTCTRL, "Control_R" }, { KEY_KPSLASH, "KP_Divide" }, { KEY_SYSRQ, "Print" },
+  { KEY_RIGHTALT, "Alt_R" }, { KEY_HOME, "Home" }, { KEY_UP, "Up" }, { KEY_PAGEUP, "Prior" },
+  { KEY_LEFT, "Left" }, { KEY_RIGHT, "Right" }, { KEY_END, "End" }, { KEY_DOWN, "Down" },
+  { KEY_PAGEDOWN, "Next" }, { KEY_INSERT, "Insert" }, { KEY_DELETE, "Delete" },
+  { KEY_MUTE, "XF86AudioMute" }, { KEY_VOLUMEDOWN, "XF86AudioLowerVolume" },
+  { KEY_VOLUMEUP, "XF86AudioRaiseVolume" }, { KEY_PAUSE, "Pause" }, { KEY_LEFTMETA, "Super_L" },
+  { KEY_RIGHTMETA, "Super_R" }, { KEY_COMPOSE, "Menu" }
+};
+
+GEvdevSource::GEvdevSource(const vector<string> &devices): devices(devices)
+{
+}
+
+GEvdevSource::~GEvdevSource()
+{
+  for (unsigned i=0; i<fds.size(); ++i)
+    close(fds[i].fd);
+}
+
+void GEvdevSource::open()
+{
+  GKeyNames names;
+  glob_t found;
+
+  if (devices.empty())
+    {
+      if (glob("/dev/input/event*", 0, NULL, &found)==0)
+	{
+	  for (size_t i=0; i<found.gl_pathc; ++i)
+	    addDevice(found.gl_pathv[i], true);
+	  globfree(&found);
+	}
+      if (fds.empty())
+	criticalError("No keyboard found in /dev/input (you may need to be in the input group)");
+    }
+  else
+    for (unsigned i=0; i<devices.size(); ++i)
+      {
+	if (!addDevice(devices[i], false))
+	  criticalError("Can't read "+devices[i]);
+      }
+
+  names.fill("NoSymbol");
+  for (unsigned i=0; i<sizeof(evdevNames)/sizeof(evdevNames[0]); ++i)
+    names[evdevNames[i].first+8] = evdevNames[i].second;
+  keymap.assign(names);
+}
+
+void GEvdevSource::run(GKeySink *sink, int signalFd)
+{
+  struct input_event batch[EVDEV_BATCH];
+  vector<struct pollfd> polled(fds);
+  unsigned remaining = fds.size();
+  ssize_t len;
+
+  polled.push_back(pollfd());
+  polled.back().fd = signalFd;
+  polled.back().events = POLLIN;
+
+  while (remaining)
+    {
+      if ( (poll(&polled[0], polled.size(), -1)<0) && (errno!=EINTR) )
+	criticalError("Can't wait for input events");
+      if ( (polled.back().revents & POLLIN) && (exitSignal(signalFd, sink)) )
+	break;
+
+      for (unsigned d=0; d<fds.size(); ++d)
+	{
+	  if (polled[d].fd<0)
+	    continue;
+	  if (!(polled[d].revents & (POLLIN | POLLHUP | POLLERR)))
+	    continue;
+
+	  // Drain the device, a batch at a time
+	  while ( (len = read(polled[d].fd, batch, sizeof(batch)))>0 )
+	    {
+	      GLatencyTimer timer(recorderStats.capture);
+	      for (size_t i=0; i<len/sizeof(batch[0]); ++i)
+		keyEvent(sink, batch[i], live[d]);
+	    }
+	  if ( (len==0) || ( (len<0) && (errno!=EAGAIN) && (errno!=EINTR) ) )
+	    {
+	      // End of a dump, or the device is gone (unplugged)
+	      polled[d].fd = -1;
+	      --remaining;
+	    }
+	}
+    }
+}
+
+/* Key presses go to the recorder, as X does, autorepeat included */
+void GEvdevSource::keyEvent(GKeySink *sink, const struct input_event &ev, bool device)
+{
+  if ( (ev.type!=EV_KEY) || (ev.value==0) || (ev.code+8>255) )
+    return;
+
+  uint32_t ms = ev.input_event_sec*1000+ev.input_event_usec/1000;
+
+  if (device)
+    sink->queueKey(0, ev.code+8, ev.input_event_sec, ms);
+  else
+    waitQueue(sink, 0, ev.code+8, ev.input_event_sec, ms);
+  ++queued;
+}
+
+static bool hasKey(const unsigned long *bits, unsigned key)
+{
+  return (bits[key/(8*sizeof(unsigned long))]>>(key%(8*sizeof(unsigned long))))&1;
+}
+
+/* Keyboards have letter keys, other devices with keys (power button,
+   mice) are skipped when looking for them */
+bool GEvdevSource::addDevice(const string &path, bool keyboardsOnly)
+{
+  unsigned long bits[KEY_MAX/(8*sizeof(unsigned long))+1];
+  struct stat st;
+  struct pollfd pfd;
+  int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+  if (fd<0)
+    return false;
+  if (keyboardsOnly)
+    {
+      memset(bits, 0, sizeof(bits));
+      if ( (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits)<0) ||
+	   (!hasKey(bits, KEY_A)) || (!hasKey(bits, KEY_SPACE)) )
+	{
+	  close(fd);
+	  return false;
+	}
+    }
+
+  cerr << "Reading keys from "<<path << endl;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  fds.push_back(pfd);
+  live.push_back( (fstat(fd, &st)==0) && (S_ISCHR(st.st_mode)) );
+  return true;
+}
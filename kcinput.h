@@ -0,0 +1,199 @@
+/* @(#)kcinput.h
+ */
+
+#ifndef _KCINPUT_H
+#define _KCINPUT_H 1
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <ctime>
+#include <stdint.h>
+#include <poll.h>
+#include <linux/input.h>
+#include <X11/Xlib.h>
+
+/* Prints the error and exits, see keyCounter.cpp */
+[[noreturn]] void criticalError(std::string msg);
+
+typedef std::array<std::string, 256> GKeyNames;
+
+/* Keycode to keysym name table. It's loaded with a single request and
+   must be reloaded when the keyboard mapping changes (MappingNotify),
+   so looking up a key name never goes to the X server. Reloads replace
+   the whole table, other threads keep using their snapshot() safely */
+class GKeymap
+{
+public:
+  GKeymap(): table(std::make_shared<GKeyNames>()), loads(0)
+  {
+  }
+
+  void load(Display *dpy);
+
+  /* Only from the thread calling load() */
+  const std::string &name(unsigned char keycode) const
+  {
+    return (*table)[keycode];
+  }
+
+  /* Current table, for any thread */
+  std::shared_ptr<const GKeyNames> snapshot() const
+  {
+    return std::atomic_load(&table);
+  }
+
+  /* Replaces the whole table, for keymaps not coming from a server */
+  void assign(const GKeyNames &names)
+  {
+    std::atomic_store(&table, std::shared_ptr<const GKeyNames>(std::make_shared<GKeyNames>(names)));
+    loads++;
+  }
+
+  /* Times the table was (re)loaded from the server */
+  unsigned long reloads() const
+  {
+    return loads;
+  }
+
+private:
+  std::shared_ptr<const GKeyNames> table;
+  unsigned long loads;
+};
+
+/* Where sources leave the key presses they capture: the recorder,
+   which counts and stores them in its writer thread */
+class GKeySink
+{
+public:
+  virtual ~GKeySink()
+  {
+  }
+
+  /* Queues a key press, it's dropped if the queue is full */
+  virtual void queueKey(int action, unsigned char keycode, time_t when, uint32_t ms) = 0;
+
+  /* Same as queueKey(), but a full queue is not counted as a dropped
+     event: the caller may wait and try again */
+  virtual bool offerKey(int action, unsigned char keycode, time_t when, uint32_t ms) = 0;
+
+  /* Events lost because the queue was full */
+  virtual unsigned long droppedEvents() const = 0;
+};
+
+/* Where key presses come from. Sources queue them in the recorder, the
+   writer thread counts and stores them the same way for all of them */
+class GInputSource
+{
+public:
+  virtual ~GInputSource()
+  {
+  }
+
+  /* Gets ready to capture, before the recorder starts. Key names are
+     ready after it */
+  virtual void open() = 0;
+
+  /* Queues events until the source ends or an exit signal arrives on
+     signalFd */
+  virtual void run(GKeySink *sink, int signalFd) = 0;
+
+  /* Names of the keycodes queued */
+  const GKeymap *keyNames() const
+  {
+    return &keymap;
+  }
+
+  /* Events queued */
+  unsigned long events() const
+  {
+    return queued;
+  }
+
+  /* Times the recorder's queue was full */
+  unsigned long fullQueue() const
+  {
+    return waits;
+  }
+
+protected:
+  GKeymap keymap;
+  unsigned long queued;
+  unsigned long waits;
+
+  GInputSource(): queued(0), waits(0)
+  {
+  }
+
+  /* Sources reading files instead of live devices must not lose events */
+  void waitQueue(GKeySink *sink, int action, unsigned char keycode, time_t when, uint32_t ms);
+};
+
+/* Key presses of every X client, with the XRecord extension */
+class GXRecordSource : public GInputSource
+{
+public:
+  GXRecordSource();
+  ~GXRecordSource();
+
+  void open();
+  void run(GKeySink *sink, int signalFd);
+
+private:
+  Display *LocalDpy, *RecDpy;
+};
+
+/* Key presses read from a capture file (see GEventRecorder::setDump()),
+   as fast as the recorder takes them or at a fixed rate of events per
+   second. Saves and files follow the time of the events (see
+   GEventRecorder::setEventClock()), so stored data is the same however
+   fast it's replayed */
+class GReplaySource : public GInputSource
+{
+public:
+  GReplaySource(const std::string &path, unsigned rate);
+  ~GReplaySource();
+
+  void open();
+  void run(GKeySink *sink, int signalFd);
+
+  /* Time spent queueing */
+  double duration() const
+  {
+    return seconds;
+  }
+
+private:
+  std::string path;
+  unsigned rate;
+  const char *data;
+  long long size;
+  GKeyNames names;
+  double seconds;
+};
+
+/* Key presses read straight from the kernel input devices, no X server
+   needed (Wayland, text consoles). Every keyboard in /dev/input is used
+   unless devices are given. Anything giving struct input_event works
+   as a device: a dump of one (cat /dev/input/eventN > dump) is read
+   until its end, without losing events, so captures can be replayed */
+class GEvdevSource : public GInputSource
+{
+public:
+  GEvdevSource(const std::vector<std::string> &devices);
+  ~GEvdevSource();
+
+  void open();
+  void run(GKeySink *sink, int signalFd);
+
+private:
+  std::vector<std::string> devices;
+  std::vector<struct pollfd> fds;
+  std::vector<bool> live;	/* A device, not a dump */
+
+  void keyEvent(GKeySink *sink, const struct input_event &ev, bool device);
+  bool addDevice(const std::string &path, bool keyboardsOnly);
+};
+
+#endif /* _KCINPUT_H */
@@ -0,0 +1,258 @@
+/**
+*************************************************************
+* @file kcreport.cpp
+* @brief Buffered report writer
+*
+* Streams analysis results as text, CSV, TSV or JSON.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <charconv>
+#include "kcreport.h"
+
+using namespace std;
+
+KCReport::KCReport(int format, int fd): format(format), fd(fd), out(NULL), used(0), column(0), rows(0),
+						 started(false), sections(0)
+{
+}
+
+KCReport::KCReport(int format, string &out): format(format), fd(-1), out(&out), used(0), column(0),
+						 rows(0), started(false), sections(0)
+{
+}
+
+KCReport::~KCReport()
+{
+  if (started)
+    end();
+  if ( (format==REPORT_JSON) && (sections) )
+    put("}\n");
+  flush();
+}
+
+int KCReport::formatFromName(string_view name)
+{
+  if (name=="text")
+    return REPORT_TEXT;
+  else if (name=="csv")
+    return REPORT_CSV;
+  else if (name=="tsv")
+    return REPORT_TSV;
+  else if (name=="json")
+    return REPORT_JSON;
+
+  return -1;
+}
+
+void KCReport::begin(const vector<string> &columns)
+{
+  this->columns = columns;
+  column = 0;
+  rows = 0;
+  started = true;
+
+  if ( (format==REPORT_CSV) || (format==REPORT_TSV) )
+    {
+      for (unsigned i=0; i<columns.size(); ++i)
+	field(columns[i]);
+      endRow();
+      rows = 0;
+    }
+  else if (format==REPORT_JSON)
+    put('[');
+}
+
+void KCReport::section(string_view name)
+{
+  if (format==REPORT_JSON)
+    {
+      put((sections)?",\n":"{\n");
+      quoted(name);
+      put(": ");
+    }
+  else
+    {
+      if (sections)
+	put('\n');
+      put("# ");
+      put(name);
+      put('\n');
+    }
+  sections++;
+}
+
+void KCReport::separator()
+{
+  if (column==0)
+    {
+      if (format==REPORT_JSON)
+	put((rows)?",\n{":"\n{");
+    }
+  else
+    {
+      switch (format)
+	{
+	case REPORT_TEXT:
+	  put(';');
+	  break;
+	case REPORT_CSV:
+	case REPORT_JSON:
+	  put(',');
+	  break;
+	case REPORT_TSV:
+	  put('\t');
+	  break;
+	}
+    }
+
+  if ( (format==REPORT_JSON) && (column<columns.size()) )
+    {
+      quoted(columns[column]);
+      put(':');
+    }
+  column++;
+}
+
+void KCReport::field(string_view value)
+{
+  separator();
+  switch (format)
+    {
+    case REPORT_JSON:
+      quoted(value);
+      break;
+    case REPORT_CSV:
+      if (value.find_first_of(",\"\n")!=string_view::npos)
+	quoted(value);
+      else
+	put(value);
+      break;
+    default:
+      put(value);
+    }
+}
+
+void KCReport::field(long long value)
+{
+  char number[24];
+  to_chars_result res = to_chars(number, number+sizeof(number), value);
+
+  separator();
+  put(string_view(number, res.ptr-number));
+}
+
+void KCReport::field(double value)
+{
+  char number[32];
+  int len = snprintf(number, sizeof(number), "%.3f", value);
+
+  separator();
+  put(string_view(number, len));
+}
+
+void KCReport::endRow()
+{
+  if (format==REPORT_JSON)
+    put('}');
+  else
+    put('\n');
+  column = 0;
+  rows++;
+}
+
+void KCReport::end()
+{
+  if (format==REPORT_JSON)
+    put("\n]\n");
+  started = false;
+  flush();
+}
+
+/* CSV doubles quotes, JSON escapes them */
+void KCReport::quoted(string_view value)
+{
+  put('"');
+  for (size_t i=0; i<value.size(); ++i)
+    {
+      char c = value[i];
+      if (format==REPORT_CSV)
+	{
+	  if (c=='"')
+	    put('"');
+	  put(c);
+	}
+      else if ( (c=='"') || (c=='\\') )
+	{
+	  put('\\');
+	  put(c);
+	}
+      else if ((unsigned char)c<0x20)
+	{
+	  char escape[8];
+	  snprintf(escape, sizeof(escape), "\\u%04x", c);
+	  put(escape);
+	}
+      else
+	put(c);
+    }
+  put('"');
+}
+
+void KCReport::put(char c)
+{
+  if (used==sizeof(buffer))
+    flush();
+  buffer[used++] = c;
+}
+
+void KCReport::put(string_view data)
+{
+  size_t len;
+
+  while (!data.empty())
+    {
+      if (used==sizeof(buffer))
+	flush();
+      len = min(data.size(), sizeof(buffer)-used);
+      memcpy(buffer+used, data.data(), len);
+      used+=len;
+      data.remove_prefix(len);
+    }
+}
+
+bool KCReport::flush()
+{
+  size_t done = 0;
+  ssize_t res;
+
+  if (out)
+    {
+      out->append(buffer, used);
+      used = 0;
+      return true;
+    }
+  while (done<used)
+    {
+      res = write(fd, buffer+done, used-done);
+      if (res<0)
+	{
+	  if (errno==EINTR)
+	    continue;
+	  used = 0;
+	  return false;
+	}
+      done+=res;
+    }
+  used = 0;
+  return true;
+}
@@ -0,0 +1,126 @@
+/* @(#)kcreport.h
+ */
+
+#ifndef _KCREPORT_H
+#define _KCREPORT_H 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define REPORT_TEXT 0		/* ; separated, no header */
+#define REPORT_CSV 1
+#define REPORT_TSV 2
+#define REPORT_JSON 3
+
+#define REPORT_BUFFER_SIZE 65536
+
+/**
+ * Writes report rows as they are produced, through a single large
+ * buffer, so reports of any size use constant memory and aren't
+ * throttled by flushes.
+ *
+ * Use: begin() with the column names, then field() for every column and
+ * endRow() for every row, and end() when finished.
+ *
+ * Many reports can go one after another, each after a section() with
+ * its name: a "# name" line before them, or an object with a member
+ * per report in JSON.
+ */
+class KCReport
+{
+public:
+  /**
+   * @param format REPORT_TEXT, REPORT_CSV, REPORT_TSV or REPORT_JSON
+   * @param fd     descriptor to write to
+   */
+  KCReport(int format, int fd=1);
+
+  /**
+   * Appends to a string instead, to be sent when it can be
+   *
+   * @param format REPORT_TEXT, REPORT_CSV, REPORT_TSV or REPORT_JSON
+   * @param out    where to append
+   */
+  KCReport(int format, std::string &out);
+  ~KCReport();
+
+  /**
+   * Gets a report format from its name
+   *
+   * @param name text, csv, tsv or json
+   *
+   * @return format, -1 if unknown
+   */
+  static int formatFromName(std::string_view name);
+
+  /**
+   * Starts a report. Writes the header, if the format has one
+   *
+   * @param columns column names
+   */
+  void begin(const std::vector<std::string> &columns);
+
+  /**
+   * Starts a new report, before begin()
+   *
+   * @param name report name
+   */
+  void section(std::string_view name);
+
+  void field(std::string_view value);
+  void field(long long value);
+  void field(double value);
+
+  void field(int value)
+  {
+    field((long long)value);
+  }
+
+  void field(unsigned value)
+  {
+    field((long long)value);
+  }
+
+  void field(long value)
+  {
+    field((long long)value);
+  }
+
+  void field(unsigned long value)
+  {
+    field((long long)value);
+  }
+  void endRow();
+
+  /**
+   * Finishes the report and flushes everything
+   */
+  void end();
+
+  /**
+   * Writes buffered data
+   *
+   * @return false on write error
+   */
+  bool flush();
+
+private:
+  int format;
+  int fd;
+  std::string *out;
+  char buffer[REPORT_BUFFER_SIZE];
+  size_t used;
+  std::vector<std::string> columns;
+  unsigned column;
+  unsigned long rows;
+  bool started;
+  unsigned sections;
+
+  void put(std::string_view data);
+  void put(char c);
+  void separator();
+  void quoted(std::string_view value);
+};
+
+#endif /* _KCREPORT_H */
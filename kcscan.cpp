@@ -0,0 +1,414 @@
+/**
+*************************************************************
+* @file kcscan.cpp
+* @brief Text log lines, split
+*
+* Line by line splitting of text logs, and a scanner finding
+* delimiters many bytes at a time with SIMD instructions.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <ctype.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KC_SCAN_X86 1
+#endif
+#include "kcscan.h"
+
+using namespace std;
+
+int parseInt(string_view str)
+{
+  size_t i = 0, len = str.size();
+  bool negative = false;
+  int res = 0;
+
+  while ( (i<len) && (isspace((unsigned char)str[i])) )
+    ++i;
+
+  if ( (i<len) && ( (str[i]=='-') || (str[i]=='+') ) )
+    negative = (str[i++]=='-');
+
+  while ( (i<len) && (str[i]>='0') && (str[i]<='9') )
+    res = res*10 + (str[i++]-'0');
+
+  return (negative)?-res:res;
+}
+
+int splitStatLine(string_view line, string_view &keysym, int &value)
+{
+  size_t pos, pos2, offset;
+  int command;
+
+  offset = line.find(' ');
+  if (offset==string_view::npos)
+    return 0;
+
+  command = parseInt(line.substr(0, offset));
+  switch (command)
+    {
+    case 1:
+      pos = line.find('(', offset);
+      pos2 = line.find(')', pos);
+      if ( (pos==string_view::npos) || (pos2==string_view::npos) )
+	return 0;
+      keysym = line.substr(pos+1, pos2-pos-1);
+
+      pos = line.find(':', pos2);
+      break;
+    case 7:
+    case 8:
+    case 9:
+      pos = line.find(':');
+      break;
+    default:
+      return 0;
+    }
+
+  if (pos==string_view::npos)
+    return 0;
+
+  value = parseInt(line.substr(pos+1));
+  return command;
+}
+
+/* Bit i is set if data[i] is '\n', '(', ')' or ':'. '(' and ')' only
+   differ in the lowest bit, so they are compared as one */
+static uint64_t scalarDelimiters(const char *data)
+{
+  uint64_t bits = 0;
+
+  for (unsigned i=0; i<64; ++i)
+    {
+      char c = data[i];
+      bits|=(uint64_t)( (c=='\n') | ((c|1)==')') | (c==':') )<<i;
+    }
+  return bits;
+}
+
+#ifdef KC_SCAN_X86
+__attribute__((target("sse2")))
+static uint64_t sse2Delimiters(const char *data)
+{
+  const __m128i newline = _mm_set1_epi8('\n'), paren = _mm_set1_epi8(')'),
+    colon = _mm_set1_epi8(':'), one = _mm_set1_epi8(1);
+  uint64_t bits = 0;
+
+  for (unsigned i=0; i<4; ++i)
+    {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(data+16*i));
+      __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline),
+						_mm_cmpeq_epi8(_mm_or_si128(bytes, one), paren)),
+				   _mm_cmpeq_epi8(bytes, colon));
+      bits|=(uint64_t)(uint16_t)_mm_movemask_epi8(found)<<(16*i);
+    }
+  return bits;
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2Delimiters(const char *data)
+{
+  const __m256i newline = _mm256_set1_epi8('\n'), paren = _mm256_set1_epi8(')'),
+    colon = _mm256_set1_epi8(':'), one = _mm256_set1_epi8(1);
+  uint64_t bits = 0;
+
+  for (unsigned i=0; i<2; ++i)
+    {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)(data+32*i));
+      __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline),
+						      _mm256_cmpeq_epi8(_mm256_or_si256(bytes, one), paren)),
+				      _mm256_cmpeq_epi8(bytes, colon));
+      bits|=(uint64_t)(uint32_t)_mm256_movemask_epi8(found)<<(32*i);
+    }
+  return bits;
+}
+#endif
+
+struct KCScanEngine
+{
+  const char *name;
+  uint64_t (*delimiters)(const char *data);
+  bool (*supported)();
+};
+
+static const KCScanEngine engines[] =
+  {
+#ifdef KC_SCAN_X86
+    { "avx2", avx2Delimiters, []() { __builtin_cpu_init(); return (bool)__builtin_cpu_supports("avx2"); } },
+    { "sse2", sse2Delimiters, []() { __builtin_cpu_init(); return (bool)__builtin_cpu_supports("sse2"); } },
+#endif
+    { "scalar", scalarDelimiters, []() { return true; } }
+  };
+
+static int forcedEngine = -1;
+
+/* The first one this CPU can run */
+static int currentEngine()
+{
+  static const int best = []()
+    {
+      unsigned i = 0;
+      while (!engines[i].supported())
+	++i;
+      return (int)i;
+    }();
+
+  return (forcedEngine>=0)?forcedEngine:best;
+}
+
+const char *KCLineScanner::engine()
+{
+  return engines[currentEngine()].name;
+}
+
+bool KCLineScanner::setEngine(const string &name)
+{
+  for (unsigned i=0; i<sizeof(engines)/sizeof(engines[0]); ++i)
+    {
+      if ( (name==engines[i].name) && (engines[i].supported()) )
+	{
+	  forcedEngine = i;
+	  return true;
+	}
+    }
+  return false;
+}
+
+/* Up to 8 digits at data as a number, digits gets how many of them were
+   there. Digits are the lowest bytes of a little endian word: anything
+   else is found with a single mask, and they are added in pairs, then
+   fours, then eights, with no branches */
+static inline uint64_t eightDigits(const char *data, unsigned &digits)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t word, other;
+
+  memcpy(&word, data, 8);
+  word^=0x3030303030303030ULL;
+  other = ((word+0x7676767676767676ULL)|word)&0x8080808080808080ULL;
+  digits = (other)?__builtin_ctzll(other)/8:8;
+  if (!digits)
+    return 0;
+
+  word<<=8*(8-digits);
+  word = (word*10+(word>>8))&0x00FF00FF00FF00FFULL;
+  word = (word*100+(word>>16))&0x0000FFFF0000FFFFULL;
+  return (word*10000+(word>>32))&0xFFFFFFFFULL;
+#else
+  uint64_t value = 0;
+
+  for (digits=0; (digits<8) && (data[digits]>='0') && (data[digits]<='9'); ++digits)
+    value = value*10+(data[digits]-'0');
+  return value;
+#endif
+}
+
+/* Reads the digits at data (there must be 16 readable bytes), wrapping
+   as parseInt() does. False if there are none or too many */
+static inline bool readNumber(const char *data, int &value)
+{
+  static const uint64_t powers[] = { 1, 10, 100, 1000, 10000, 100000, 1000000,
+				     10000000, 100000000 };
+  unsigned digits, more;
+  uint64_t number = eightDigits(data, digits);
+
+  if (!digits)
+    return false;
+  if (digits==8)
+    {
+      uint64_t rest = eightDigits(data+8, more);
+      if (more==8)
+	return false;
+      number = number*powers[more]+rest;
+    }
+  value = (int)(uint32_t)number;
+  return true;
+}
+
+KCLineScanner::KCLineScanner(string_view buffer): buffer(buffer), pos(0), chunk(0), bits(0),
+						  delimiters(engines[currentEngine()].delimiters)
+{
+  if (!buffer.empty())
+    load();
+}
+
+void KCLineScanner::load()
+{
+  if (chunk+64<=buffer.size())
+    bits = delimiters(buffer.data()+chunk);
+  else
+    {
+      // The last bytes, padded with zeros that are never delimiters
+      char tail[64];
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, buffer.data()+chunk, buffer.size()-chunk);
+      bits = delimiters(tail);
+    }
+}
+
+/* Next delimiter, npos after the last one */
+inline size_t KCLineScanner::take()
+{
+  while (!bits)
+    {
+      chunk+=64;
+      if (chunk>=buffer.size())
+	return string_view::npos;
+      load();
+    }
+
+  size_t at = chunk+__builtin_ctzll(bits);
+  bits&=bits-1;
+  return at;
+}
+
+/* Lines as the recorder writes them, "1 Press (keysym) : presses" or
+   "9 Save: timestamp" (7 and 8 too), have their delimiters in a fixed
+   order, so they are split with no decisions to make */
+inline bool KCLineScanner::quick(KCStatLine &out)
+{
+  const char *data = buffer.data();
+  size_t start = pos, open, close, colon, eol;
+
+  if ( (pos+2>buffer.size()) || (data[pos+1]!=' ') )
+    return false;
+
+  if (data[pos]=='1')
+    {
+      open = take();
+      close = take();
+      colon = take();
+      eol = take();
+      if ( (eol==string_view::npos) || (data[open]!='(') || (data[close]!=')') || (data[colon]!=':') ||
+	   (data[eol]!='\n') )
+	return false;
+      out.keysym = buffer.substr(open+1, close-open-1);
+    }
+  else if ( (data[pos]>='7') && (data[pos]<='9') )
+    {
+      colon = take();
+      eol = take();
+      if ( (eol==string_view::npos) || (data[colon]!=':') || (data[eol]!='\n') )
+	return false;
+      out.keysym = string_view();
+    }
+  else
+    return false;
+
+  if ( (colon+18>buffer.size()) || (data[colon+1]!=' ') || (!readNumber(data+colon+2, out.value)) )
+    return false;
+
+  out.command = data[start]-'0';
+  out.line = buffer.substr(start, eol-start);
+  pos = eol+1;
+  return true;
+}
+
+bool KCLineScanner::next(KCStatLine &out)
+{
+  const size_t npos = string_view::npos;
+  size_t start = pos, eol = npos, open = npos, close = npos, colon = npos, firstColon = npos;
+  size_t lastChunk = chunk;
+  uint64_t lastBits = bits;
+
+  if (pos>=buffer.size())
+    return false;
+  if (quick(out))
+    return true;
+
+  // Anything else, delimiter by delimiter from the start of the line,
+  // keeping the ones splitStatLine() would find
+  if (chunk!=lastChunk)
+    {
+      chunk = lastChunk;
+      load();
+    }
+  bits = lastBits;
+  while (eol==npos)
+    {
+      while (!bits)
+	{
+	  chunk+=64;
+	  if (chunk>=buffer.size())
+	    break;
+	  load();
+	}
+      if (!bits)
+	{
+	  eol = buffer.size();
+	  break;
+	}
+
+      size_t at = chunk+__builtin_ctzll(bits);
+      bits&=bits-1;
+      switch (buffer[at])
+	{
+	case '\n':
+	  eol = at;
+	  break;
+	case '(':
+	  if (open==npos)
+	    open = at;
+	  break;
+	case ')':
+	  if ( (open!=npos) && (close==npos) )
+	    close = at;
+	  break;
+	default:
+	  if (firstColon==npos)
+	    firstColon = at;
+	  if ( (close!=npos) && (colon==npos) )
+	    colon = at;
+	}
+    }
+
+  pos = eol+1;
+  out.line = buffer.substr(start, eol-start);
+  if (!canonical(start, eol, open, close, colon, firstColon, out))
+    out.command = splitStatLine(out.line, out.keysym, out.value);
+  return true;
+}
+
+/* Lines as the recorder writes them: "1 Press (keysym) : presses" or
+   "9 Save: timestamp" (7 and 8 too), a single space before the number */
+bool KCLineScanner::canonical(size_t start, size_t eol, size_t open, size_t close, size_t colon,
+			      size_t firstColon, KCStatLine &out) const
+{
+  const size_t npos = string_view::npos;
+  size_t number;
+
+  if ( (eol-start<2) || (buffer[start+1]!=' ') )
+    return false;
+
+  switch (buffer[start])
+    {
+    case '1':
+      if (colon==npos)
+	return false;
+      out.keysym = buffer.substr(open+1, close-open-1);
+      number = colon+1;
+      break;
+    case '7':
+    case '8':
+    case '9':
+      if (firstColon==npos)
+	return false;
+      out.keysym = string_view();
+      number = firstColon+1;
+      break;
+    default:
+      return false;
+    }
+
+  if ( (number+17>buffer.size()) || (buffer[number]!=' ') ||
+       (!readNumber(buffer.data()+number+1, out.value)) )
+    return false;
+
+  out.command = buffer[start]-'0';
+  return true;
+}
@@ -0,0 +1,72 @@
+/* @(#)kcscan.h
+ */
+
+#ifndef _KCSCAN_H
+#define _KCSCAN_H 1
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+/* atoi() replacement working on a non null-terminated view:
+   leading blanks, optional sign, digits until the first non digit */
+int parseInt(std::string_view str);
+
+/* Splits a text log line into its fields. Returns the record type (1, 7,
+   8 or 9) filling keysym (key presses only) and value (presses or
+   timestamp), or 0 if the line is wrong */
+int splitStatLine(std::string_view line, std::string_view &keysym, int &value);
+
+/* A text log line, split */
+struct KCStatLine
+{
+  std::string_view line;
+  std::string_view keysym;
+  int command;			/* As splitStatLine() returns */
+  int value;
+};
+
+/**
+ * Splits a whole text log, giving the same fields as splitStatLine()
+ * line after line. Newlines and delimiters are found 64 bytes at a time
+ * with SSE2 or AVX2 (whatever the CPU has, or plain C++ elsewhere) and
+ * numbers are read 8 digits at a time. Lines not written as the recorder
+ * writes them are left to splitStatLine().
+ */
+class KCLineScanner
+{
+public:
+  KCLineScanner(std::string_view buffer);
+
+  /**
+   * @param out next line, command 0 if it's wrong
+   *
+   * @return false at the end of the buffer
+   */
+  bool next(KCStatLine &out);
+
+  /* Engine in use: "avx2", "sse2" or "scalar" */
+  static const char *engine();
+
+  /**
+   * Uses another engine, for all scanners created after this
+   *
+   * @return false if the name is unknown or this CPU can't run it
+   */
+  static bool setEngine(const std::string &name);
+
+private:
+  std::string_view buffer;
+  size_t pos;			/* Start of the next line */
+  size_t chunk;			/* Start of the 64 bytes in bits */
+  uint64_t bits;		/* Delimiters of the chunk not seen yet */
+  uint64_t (*delimiters)(const char *data);
+
+  void load();
+  size_t take();
+  bool quick(KCStatLine &out);
+  bool canonical(size_t start, size_t eol, size_t open, size_t close, size_t colon,
+		 size_t firstColon, KCStatLine &out) const;
+};
+
+#endif /* _KCSCAN_H */
@@ -0,0 +1,283 @@
+/**
+*************************************************************
+* @file kcsegment.cpp
+* @brief Compact binary log segments
+*
+* Varint and delta encoded version of the text logs written by
+* the recorder, with a checksum on every block.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <string.h>
+#include <array>
+#include "kcsegment.h"
+
+using namespace std;
+
+void kcPutVarint(string &out, uint64_t value)
+{
+  while (value>=0x80)
+    {
+      out+=(char)((value&0x7F)|0x80);
+      value>>=7;
+    }
+  out+=(char)value;
+}
+
+void kcPutZigzag(string &out, int64_t value)
+{
+  kcPutVarint(out, ((uint64_t)value<<1) ^ (uint64_t)(value>>63));
+}
+
+bool kcGetVarint(string_view data, size_t &pos, uint64_t &value)
+{
+  unsigned shift = 0;
+
+  value = 0;
+  while (pos<data.size())
+    {
+      unsigned char c = data[pos++];
+      value|=(uint64_t)(c&0x7F)<<shift;
+      if (!(c&0x80))
+	return true;
+
+      shift+=7;
+      if (shift>63)
+	return false;
+    }
+  return false;
+}
+
+bool kcGetZigzag(string_view data, size_t &pos, int64_t &value)
+{
+  uint64_t raw;
+
+  if (!kcGetVarint(data, pos, raw))
+    return false;
+
+  value = (int64_t)(raw>>1) ^ -(int64_t)(raw&1);
+  return true;
+}
+
+uint32_t kcCrc32(const char *data, size_t len)
+{
+  // Built once, before any thread can use it (recorder and parsers call
+  // this at the same time)
+  static const array<uint32_t, 256> table = []()
+    {
+      array<uint32_t, 256> t;
+      for (uint32_t i=0; i<256; ++i)
+	{
+	  uint32_t c = i;
+	  for (int k=0; k<8; ++k)
+	    c = (c&1)?(0xEDB88320 ^ (c>>1)):(c>>1);
+	  t[i] = c;
+	}
+      return t;
+    }();
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i=0; i<len; ++i)
+    crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc>>8);
+
+  return crc ^ 0xFFFFFFFF;
+}
+
+bool isBinarySegment(string_view data)
+{
+  return ( (data.size()>=4) && (data.compare(0, 3, KC_SEGMENT_MAGIC)==0) );
+}
+
+KCSegmentWriter::KCSegmentWriter(): lastSave(0)
+{
+}
+
+string KCSegmentWriter::header(time_t created)
+{
+  string out = KC_SEGMENT_MAGIC;
+
+  out+=(char)KC_SEGMENT_VERSION;
+  kcPutVarint(out, created);
+
+  return out;
+}
+
+void KCSegmentWriter::defineKey(unsigned id, const string &name)
+{
+  map<unsigned, string>::iterator w = written.find(id);
+
+  if ( (w!=written.end()) && (w->second==name) )
+    pending.erase(id);
+  else
+    pending[id] = name;
+}
+
+unsigned KCSegmentWriter::keyId(const string &name)
+{
+  map<string, unsigned>::iterator i = ids.find(name);
+
+  if (i!=ids.end())
+    return i->second;
+
+  unsigned id = ids.size();
+  ids[name] = id;
+  defineKey(id, name);
+  return id;
+}
+
+string KCSegmentWriter::block(const KCBlock &block)
+{
+  string payload, out;
+  uint32_t crc;
+
+  payload+=(char)( (block.hasSave)?KC_BLOCK_HAS_SAVE:0 );
+  kcPutZigzag(payload, (int64_t)block.save - lastSave);
+
+  for (size_t i=0; i<block.names.size(); ++i)
+    defineKey(block.names[i].first, block.names[i].second);
+
+  kcPutVarint(payload, pending.size());
+  for (map<unsigned, string>::iterator i=pending.begin(); i!=pending.end(); ++i)
+    {
+      kcPutVarint(payload, i->first);
+      kcPutVarint(payload, i->second.size());
+      payload+=i->second;
+      written[i->first] = i->second;
+    }
+  pending.clear();
+
+  kcPutVarint(payload, block.typing.size());
+  for (size_t i=0; i<block.typing.size(); ++i)
+    {
+      payload+=(char)block.typing[i].first;
+      kcPutZigzag(payload, (int64_t)block.typing[i].second - block.save);
+    }
+
+  kcPutVarint(payload, block.keys.size());
+  for (size_t i=0; i<block.keys.size(); ++i)
+    {
+      kcPutVarint(payload, block.keys[i].id);
+      kcPutVarint(payload, block.keys[i].presses);
+    }
+
+  lastSave = block.save;
+
+  out+=(char)KC_BLOCK_MARK;
+  kcPutVarint(out, payload.size());
+  crc = kcCrc32(payload.data(), payload.size());
+  for (int i=0; i<4; ++i)
+    out+=(char)((crc>>(8*i))&0xFF);
+  out+=payload;
+
+  return out;
+}
+
+KCSegmentReader::KCSegmentReader(string_view data): data(data), pos(0), lastSave(0)
+{
+}
+
+const string &KCSegmentReader::keyName(unsigned id) const
+{
+  static const string none;
+
+  return (id<names.size())?names[id]:none;
+}
+
+int KCSegmentReader::next(KCBlock &block)
+{
+  uint64_t len, value, count;
+  int64_t delta;
+  uint32_t crc = 0;
+  size_t p;
+
+  block.clear();
+  if (pos==0)
+    {
+      if ( (!isBinarySegment(data)) || (data[3]!=KC_SEGMENT_VERSION) )
+	return -1;
+      pos = 4;
+      if (!kcGetVarint(data, pos, value))
+	return -1;
+    }
+
+  if (pos>=data.size())
+    return 0;
+
+  if (data[pos]!=KC_BLOCK_MARK)
+    return -4;
+
+  p = pos+1;
+  if ( (!kcGetVarint(data, p, len)) || (p+4>data.size()) )
+    return -2;
+
+  for (int i=0; i<4; ++i)
+    crc|=(uint32_t)(unsigned char)data[p++]<<(8*i);
+
+  if (len>data.size()-p)
+    return -2;
+
+  if (kcCrc32(data.data()+p, len)!=crc)
+    return -3;
+
+  string_view payload = data.substr(p, len);
+  size_t end = p+len;
+  p = 0;
+
+  if (payload.empty())
+    return -4;
+  block.hasSave = payload[p++] & KC_BLOCK_HAS_SAVE;
+
+  if (!kcGetZigzag(payload, p, delta))
+    return -4;
+  block.save = lastSave+delta;
+
+  if (!kcGetVarint(payload, p, count))
+    return -4;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      uint64_t id;
+      if ( (!kcGetVarint(payload, p, id)) || (!kcGetVarint(payload, p, len)) ||
+	   (len>payload.size()-p) || (id>0xFFFFFF) )
+	return -4;
+
+      if (id>=names.size())
+	names.resize(id+1);
+      names[id] = string(payload.substr(p, len));
+      block.names.push_back(make_pair((unsigned)id, names[id]));
+      p+=len;
+    }
+
+  if (!kcGetVarint(payload, p, count))
+    return -4;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if (p>=payload.size())
+	return -4;
+      int kind = payload[p++];
+      // Only stops and starts, anything else would confuse burst counting
+      if ( ( (kind!=7) && (kind!=8) ) || (!kcGetZigzag(payload, p, delta)) )
+	return -4;
+      block.typing.push_back(make_pair(kind, (time_t)(block.save+delta)));
+    }
+
+  if (!kcGetVarint(payload, p, count))
+    return -4;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      KCKeyCount key;
+      uint64_t id;
+      if ( (!kcGetVarint(payload, p, id)) || (!kcGetVarint(payload, p, value)) )
+	return -4;
+      key.id = id;
+      key.presses = value;
+      block.keys.push_back(key);
+    }
+
+  lastSave = block.save;
+  pos = end;
+  return 1;
+}
@@ -0,0 +1,221 @@
+/* @(#)kcsegment.h
+ */
+
+#ifndef _KCSEGMENT_H
+#define _KCSEGMENT_H 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <stdint.h>
+
+/*
+ * Binary log segment layout:
+ *
+ *   header:  "KCB" version(1 byte) varint(creation time)
+ *   block:   'B' varint(payload length) crc32(payload, 4 bytes LE) payload
+ *
+ *   payload: flags(1 byte, bit 0: has save mark)
+ *            zigzag(save time - previous block save time)
+ *            varint(name count)   { varint(key id) varint(length) bytes }
+ *            varint(typing count) { kind(1 byte, 7 or 8) zigzag(time - save time) }
+ *            varint(key count)    { varint(key id) varint(presses) }
+ *
+ * Every block is what the text format writes on a single save: the
+ * "9 Save" mark, "7 Stop"/"8 Start typing" marks and "1 Press" lines.
+ * Key ids are only meaningful inside a segment, their names are given
+ * the first time they are used (or again if they change).
+ */
+
+#define KC_SEGMENT_MAGIC "KCB"
+#define KC_SEGMENT_VERSION 1
+#define KC_BLOCK_MARK 'B'
+#define KC_BLOCK_HAS_SAVE 1
+
+struct KCKeyCount
+{
+  unsigned id;
+  unsigned presses;
+};
+
+struct KCBlock
+{
+  bool hasSave;
+  time_t save;
+  std::vector<std::pair<int, time_t> > typing; /* (7 stop | 8 start, timestamp) */
+  std::vector<KCKeyCount> keys;
+  std::vector<std::pair<unsigned, std::string> > names; /* New or changed key names */
+
+  void clear()
+  {
+    hasSave = false;
+    save = 0;
+    typing.clear();
+    keys.clear();
+    names.clear();
+  }
+};
+
+/**
+ * Appends an unsigned LEB128 varint
+ *
+ * @param out   where to append it
+ * @param value value to encode
+ */
+void kcPutVarint(std::string &out, uint64_t value);
+
+/**
+ * Appends a signed value as a zigzag varint, so small negative values
+ * take few bytes too
+ *
+ * @param out   where to append it
+ * @param value value to encode
+ */
+void kcPutZigzag(std::string &out, int64_t value);
+
+/**
+ * Reads an unsigned LEB128 varint
+ *
+ * @param data  buffer
+ * @param pos   where to read from, updated past the value
+ * @param value where to store the value
+ *
+ * @return false if the buffer ends before the value does
+ */
+bool kcGetVarint(std::string_view data, size_t &pos, uint64_t &value);
+
+/**
+ * Reads a zigzag varint written with kcPutZigzag()
+ *
+ * @param data  buffer
+ * @param pos   where to read from, updated past the value
+ * @param value where to store the value
+ *
+ * @return false if the buffer ends before the value does
+ */
+bool kcGetZigzag(std::string_view data, size_t &pos, int64_t &value);
+
+/**
+ * Checks if a buffer holds a binary segment
+ *
+ * @param data file contents
+ *
+ * @return true if it starts with a binary segment header
+ */
+bool isBinarySegment(std::string_view data);
+
+/**
+ * Builds the CRC-32 (IEEE) of a buffer
+ *
+ * @param data buffer
+ * @param len  buffer length
+ *
+ * @return checksum
+ */
+uint32_t kcCrc32(const char *data, size_t len);
+
+/**
+ * Serializes blocks of a single binary segment. It remembers the last
+ * save time and the key names already written, so the same writer must
+ * be used for the whole segment.
+ */
+class KCSegmentWriter
+{
+public:
+  KCSegmentWriter();
+
+  /**
+   * Segment header, to be written once at the beginning of the file
+   *
+   * @param created creation time
+   *
+   * @return header bytes
+   */
+  std::string header(time_t created);
+
+  /**
+   * Sets the name of a key id. It will be written with the next block
+   * if it wasn't written before or it has changed.
+   *
+   * @param id   key id
+   * @param name key name
+   */
+  void defineKey(unsigned id, const std::string &name);
+
+  /**
+   * Gets a key id for a name, assigning a new one if needed. Useful when
+   * we only know key names (i.e. converting text logs)
+   *
+   * @param name key name
+   *
+   * @return key id
+   */
+  unsigned keyId(const std::string &name);
+
+  /**
+   * Serializes a block. Key names pending to be written (see defineKey())
+   * are added to it.
+   *
+   * @param block block to write
+   *
+   * @return block bytes
+   */
+  std::string block(const KCBlock &block);
+
+private:
+  time_t lastSave;
+  std::map<unsigned, std::string> written;
+  std::map<unsigned, std::string> pending;
+  std::map<std::string, unsigned> ids;
+};
+
+/**
+ * Reads blocks from a binary segment in memory, keeping the key names
+ * defined so far.
+ */
+class KCSegmentReader
+{
+public:
+  /**
+   * @param data whole segment, header included
+   */
+  KCSegmentReader(std::string_view data);
+
+  /**
+   * Decodes next block
+   *
+   * @param block where to store the block
+   *
+   * @return 1 if a block was read, 0 at the end of the segment, -1 if
+   *         the header is wrong, -2 if the block is truncated, -3 if the
+   *         checksum doesn't match, -4 if the block is malformed
+   */
+  int next(KCBlock &block);
+
+  /**
+   * Name of a key id, as defined by the blocks read so far
+   *
+   * @param id key id
+   *
+   * @return name, empty if undefined
+   */
+  const std::string &keyName(unsigned id) const;
+
+  /**
+   * Offset of the next block to be read
+   */
+  size_t offset() const
+  {
+    return pos;
+  }
+
+private:
+  std::string_view data;
+  size_t pos;
+  time_t lastSave;
+  std::vector<std::string> names;
+};
+
+#endif /* _KCSEGMENT_H */
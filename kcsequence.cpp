@@ -0,0 +1,328 @@
+/**
+*************************************************************
+* @file kcsequence.cpp
+* @brief Keys typed one after another
+*
+* Bigram matrices and trigram tables of a log segment, which
+* can be written, read and added by key name.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include "cfileutils.h"
+#include "kcsegment.h"
+#include "kcsequence.h"
+
+using namespace std;
+
+KCSequences::KCSequences(): pairs(256*256, 0), lost(0), gapTotal(0)
+{
+}
+
+void KCSequences::clear()
+{
+  fill(pairs.begin(), pairs.end(), 0);
+  trigrams.clear();
+  lost = 0;
+  gaps = KCHistogram();
+  gapTotal = 0;
+}
+
+void KCSequences::triple(unsigned char first, unsigned char second, unsigned char third)
+{
+  uint32_t code = (first<<16)|(second<<8)|third;
+  unordered_map<uint32_t, uint32_t>::iterator t = trigrams.find(code);
+
+  if (t!=trigrams.end())
+    t->second++;
+  else if (trigrams.size()<KC_TRIGRAM_LIMIT)
+    trigrams.emplace(code, 1);
+  else
+    lost++;
+}
+
+string KCSequences::serialize() const
+{
+  string out = KC_SEQUENCE_MAGIC;
+  vector<uint32_t> codes;
+  bool used[256];
+  uint64_t count = 0, previous = 0;
+  uint32_t crc;
+
+  out+=(char)KC_SEQUENCE_VERSION;
+
+  memset(used, 0, sizeof(used));
+  for (unsigned i=0; i<pairs.size(); ++i)
+    {
+      if (pairs[i])
+	{
+	  used[i>>8] = used[i&0xFF] = true;
+	  ++count;
+	}
+    }
+  codes.reserve(trigrams.size());
+  for (unordered_map<uint32_t, uint32_t>::const_iterator t=trigrams.begin(); t!=trigrams.end(); ++t)
+    {
+      codes.push_back(t->first);
+      used[t->first>>16] = used[(t->first>>8)&0xFF] = used[t->first&0xFF] = true;
+    }
+  sort(codes.begin(), codes.end());
+
+  kcPutVarint(out, count_if(used, used+256, [](bool u) { return u; }));
+  for (unsigned i=0; i<256; ++i)
+    {
+      if (!used[i])
+	continue;
+      kcPutVarint(out, i);
+      kcPutVarint(out, names[i].size());
+      out+=names[i];
+    }
+
+  kcPutVarint(out, count);
+  for (unsigned i=0; i<pairs.size(); ++i)
+    {
+      if (!pairs[i])
+	continue;
+      kcPutVarint(out, i-previous);
+      kcPutVarint(out, pairs[i]);
+      previous = i;
+    }
+
+  kcPutVarint(out, codes.size());
+  previous = 0;
+  for (unsigned i=0; i<codes.size(); ++i)
+    {
+      kcPutVarint(out, codes[i]-previous);
+      kcPutVarint(out, trigrams.find(codes[i])->second);
+      previous = codes[i];
+    }
+  kcPutVarint(out, lost);
+  kcPutVarint(out, gapTotal);
+  gaps.serialize(out);
+
+  crc = kcCrc32(out.data(), out.size());
+  for (int i=0; i<4; ++i)
+    out+=(char)((crc>>(8*i))&0xFF);
+  return out;
+}
+
+bool KCSequences::unserialize(string_view data)
+{
+  size_t pos = 4;
+  uint64_t count, value, len, code = 0, presses;
+  uint32_t crc = 0;
+  int version;
+
+  clear();
+  names.fill("");
+  if ( (data.size()<8) || (data.compare(0, 3, KC_SEQUENCE_MAGIC)!=0) )
+    return false;
+  version = data[3];
+  if ( (version<1) || (version>KC_SEQUENCE_VERSION) )
+    return false;
+  for (int i=0; i<4; ++i)
+    crc|=(uint32_t)(unsigned char)data[data.size()-4+i]<<(8*i);
+  if (kcCrc32(data.data(), data.size()-4)!=crc)
+    return false;
+  data = data.substr(0, data.size()-4);
+
+  if (!kcGetVarint(data, pos, count))
+    return false;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if ( (!kcGetVarint(data, pos, value)) || (value>255) ||
+	   (!kcGetVarint(data, pos, len)) || (len>data.size()-pos) )
+	return false;
+      names[value] = string(data.substr(pos, len));
+      pos+=len;
+    }
+
+  if (!kcGetVarint(data, pos, count))
+    return false;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if ( (!kcGetVarint(data, pos, value)) || (!kcGetVarint(data, pos, presses)) )
+	return false;
+      code+=value;
+      if (code>=pairs.size())
+	return false;
+      pairs[code] = presses;
+    }
+
+  if (!kcGetVarint(data, pos, count))
+    return false;
+  code = 0;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if ( (!kcGetVarint(data, pos, value)) || (!kcGetVarint(data, pos, presses)) )
+	return false;
+      code+=value;
+      if (code>0xFFFFFF)
+	return false;
+      trigrams[code] = presses;
+    }
+
+  if (!kcGetVarint(data, pos, lost))
+    return false;
+  if ( (version>=2) && ( (!kcGetVarint(data, pos, gapTotal)) || (!gaps.unserialize(data, pos)) ) )
+    return false;
+  return (pos==data.size());
+}
+
+bool KCSequences::save(const string &path) const
+{
+  string temp = path+".tmp";
+  ofstream of(temp.c_str(), ios::trunc | ios::binary);
+
+  if (!of.is_open())
+    return false;
+  of << serialize();
+  of.close();
+
+  return ( (!of.fail()) && (rename(temp.c_str(), path.c_str())==0) );
+}
+
+int KCSequences::load(const string &path)
+{
+  const char *data;
+  long long size;
+  bool ok;
+
+  size = file_map(&data, path.c_str());
+  if (size<0)
+    return -1;
+
+  ok = unserialize(string_view(data, size));
+  file_unmap(data, size);
+  return (ok)?0:-2;
+}
+
+KCSequenceTotals::KCSequenceTotals(): size(0), lost(0), gapTotal(0)
+{
+}
+
+unsigned KCSequenceTotals::id(const string &name)
+{
+  map<string, unsigned, less<> >::iterator i = ids.find(name);
+
+  if (i!=ids.end())
+    return i->second;
+
+  unsigned next = idNames.size();
+  if (next>=size)
+    {
+      // Grow the matrix, keeping what it has
+      unsigned bigger = (size)?size*2:256;
+      vector<uint64_t> grown(bigger*bigger, 0);
+
+      for (unsigned r=0; r<size; ++r)
+	copy(matrix.begin()+r*size, matrix.begin()+(r+1)*size, grown.begin()+r*bigger);
+      matrix.swap(grown);
+      size = bigger;
+    }
+  ids.emplace(name, next);
+  idNames.push_back(name);
+  return next;
+}
+
+void KCSequenceTotals::add(const KCSequences &sequences)
+{
+  int local[256];		/* Keycode to id, -1 until needed */
+
+  fill(local, local+256, -1);
+  for (unsigned first=0; first<256; ++first)
+    for (unsigned second=0; second<256; ++second)
+      {
+	uint32_t presses = sequences.pairCount(first, second);
+	if (!presses)
+	  continue;
+	if (local[first]<0)
+	  local[first] = id(sequences.name(first));
+	if (local[second]<0)
+	  local[second] = id(sequences.name(second));
+	matrix[local[first]*size+local[second]]+=presses;
+      }
+
+  for (unordered_map<uint32_t, uint32_t>::const_iterator t=sequences.triples().begin();
+       t!=sequences.triples().end(); ++t)
+    {
+      uint64_t key = 0;
+      for (int shift=16; shift>=0; shift-=8)
+	{
+	  unsigned keycode = (t->first>>shift)&0xFF;
+	  if (local[keycode]<0)
+	    local[keycode] = id(sequences.name(keycode));
+	  key = (key<<21)|local[keycode];
+	}
+      triples[key]+=t->second;
+    }
+  lost+=sequences.lostTriples();
+  gaps.merge(sequences.intervals());
+  gapTotal+=sequences.intervalTotal();
+}
+
+static bool morePresses(const KCSequenceTotals::Entry &a, const KCSequenceTotals::Entry &b)
+{
+  if (a.presses!=b.presses)
+    return a.presses>b.presses;
+  for (unsigned i=0; i<3; ++i)
+    if (a.keys[i]!=b.keys[i])
+      return a.keys[i]<b.keys[i];
+  return false;
+}
+
+static void keepTop(vector<KCSequenceTotals::Entry> &entries, size_t limit)
+{
+  if ( (limit) && (limit<entries.size()) )
+    {
+      partial_sort(entries.begin(), entries.begin()+limit, entries.end(), morePresses);
+      entries.resize(limit);
+    }
+  else
+    sort(entries.begin(), entries.end(), morePresses);
+}
+
+vector<KCSequenceTotals::Entry> KCSequenceTotals::bigrams(size_t limit) const
+{
+  vector<Entry> entries;
+  Entry entry;
+
+  for (unsigned first=0; first<idNames.size(); ++first)
+    for (unsigned second=0; second<idNames.size(); ++second)
+      {
+	if (!matrix[first*size+second])
+	  continue;
+	entry.keys[0] = idNames[first];
+	entry.keys[1] = idNames[second];
+	entry.presses = matrix[first*size+second];
+	entries.push_back(entry);
+      }
+
+  keepTop(entries, limit);
+  return entries;
+}
+
+vector<KCSequenceTotals::Entry> KCSequenceTotals::trigrams(size_t limit) const
+{
+  vector<Entry> entries;
+  Entry entry;
+
+  for (map<uint64_t, uint64_t>::const_iterator t=triples.begin(); t!=triples.end(); ++t)
+    {
+      entry.keys[0] = idNames[(t->first>>42)&0x1FFFFF];
+      entry.keys[1] = idNames[(t->first>>21)&0x1FFFFF];
+      entry.keys[2] = idNames[t->first&0x1FFFFF];
+      entry.presses = t->second;
+      entries.push_back(entry);
+    }
+
+  keepTop(entries, limit);
+  return entries;
+}
@@ -0,0 +1,186 @@
+/* @(#)kcsequence.h
+ */
+
+#ifndef _KCSEQUENCE_H
+#define _KCSEQUENCE_H 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <stdint.h>
+#include "kcsummary.h"
+
+/*
+ * Sequence file layout:
+ *
+ *   "KCQ" version(1 byte)
+ *   varint(name count)    { varint(keycode) varint(length) name }
+ *   varint(bigram count)  { varint(first*256+second - previous) varint(presses) }
+ *   varint(trigram count) { varint(first<<16|second<<8|third - previous) varint(presses) }
+ *   varint(trigrams not kept)
+ *   intervals (version 2): varint(total milliseconds) histogram, as in
+ *                      summaries
+ *   crc32(everything before, 4 bytes LE)
+ *
+ * Only the names of the keycodes used are written. Version 1 files are
+ * read as having no intervals.
+ */
+
+#define KC_SEQUENCE_MAGIC "KCQ"
+#define KC_SEQUENCE_VERSION 2
+#define KC_TRIGRAM_LIMIT 65536	/* Different trigrams kept per file */
+
+/**
+ * Keys typed one after another, by keycode: a dense 256x256 bigram
+ * matrix, so counting a pair is a single increment, and a bounded table
+ * of trigrams. Once the table is full new trigrams are only counted as
+ * lost, so memory never grows. Milliseconds between consecutive keys
+ * are kept too, in a histogram.
+ */
+class KCSequences
+{
+public:
+  KCSequences();
+
+  void clear();
+
+  /* second was pressed right after first */
+  void pair(unsigned char first, unsigned char second)
+  {
+    pairs[first*256+second]++;
+  }
+
+  void triple(unsigned char first, unsigned char second, unsigned char third);
+
+  /* ms milliseconds went by between two consecutive keys */
+  void interval(unsigned ms)
+  {
+    gaps.add(ms);
+    gapTotal+=ms;
+  }
+
+  void setName(unsigned char keycode, const std::string &name)
+  {
+    names[keycode] = name;
+  }
+
+  const std::string &name(unsigned char keycode) const
+  {
+    return names[keycode];
+  }
+
+  uint32_t pairCount(unsigned char first, unsigned char second) const
+  {
+    return pairs[first*256+second];
+  }
+
+  /* (first<<16|second<<8|third, presses) */
+  const std::unordered_map<uint32_t, uint32_t> &triples() const
+  {
+    return trigrams;
+  }
+
+  uint64_t lostTriples() const
+  {
+    return lost;
+  }
+
+  const KCHistogram &intervals() const
+  {
+    return gaps;
+  }
+
+  /* Milliseconds of all the intervals together */
+  uint64_t intervalTotal() const
+  {
+    return gapTotal;
+  }
+
+  std::string serialize() const;
+
+  /**
+   * @param data serialized sequences
+   *
+   * @return false if they are not sequences or they are corrupt
+   */
+  bool unserialize(std::string_view data);
+
+  /**
+   * Writes the file to a temporary file and renames it
+   *
+   * @return false on error
+   */
+  bool save(const std::string &path) const;
+
+  /**
+   * @return 0 on success, -1 if the file can't be read, -2 if it's not
+   *         a valid sequence file
+   */
+  int load(const std::string &path);
+
+private:
+  std::vector<uint32_t> pairs;
+  std::unordered_map<uint32_t, uint32_t> trigrams;
+  uint64_t lost;
+  KCHistogram gaps;
+  uint64_t gapTotal;
+  std::array<std::string, 256> names;
+};
+
+/**
+ * Sequences of many files added together by key name, as the same
+ * keycode may not be the same key everywhere.
+ */
+class KCSequenceTotals
+{
+public:
+  KCSequenceTotals();
+
+  void add(const KCSequences &sequences);
+
+  struct Entry
+  {
+    std::string keys[3];
+    uint64_t presses;
+  };
+
+  /**
+   * @param limit most entries to return, 0 for all of them
+   *
+   * @return bigrams (or trigrams) typed, the most typed first
+   */
+  std::vector<Entry> bigrams(size_t limit) const;
+  std::vector<Entry> trigrams(size_t limit) const;
+
+  uint64_t lostTriples() const
+  {
+    return lost;
+  }
+
+  const KCHistogram &intervals() const
+  {
+    return gaps;
+  }
+
+  uint64_t intervalTotal() const
+  {
+    return gapTotal;
+  }
+
+private:
+  std::map<std::string, unsigned, std::less<> > ids;
+  std::vector<std::string> idNames;
+  unsigned size;		/* Rows and columns of the matrix */
+  std::vector<uint64_t> matrix;
+  std::map<uint64_t, uint64_t> triples; /* (id<<42|id<<21|id, presses) */
+  uint64_t lost;
+  KCHistogram gaps;
+  uint64_t gapTotal;
+
+  unsigned id(const std::string &name);
+};
+
+#endif /* _KCSEQUENCE_H */
@@ -0,0 +1,161 @@
+/* @(#)kcstats.h
+ */
+
+#ifndef _KCSTATS_H
+#define _KCSTATS_H 1
+
+#include <atomic>
+#include <algorithm>
+#include <time.h>
+#include <stdint.h>
+#include "kcsummary.h"
+#include "kcreport.h"
+
+/* Distribution of a value measured on the recorder's hot path (most of
+   them nanoseconds). Only one thread adds to each one, so it's cheap,
+   but any thread can read it */
+class GLatency
+{
+public:
+  GLatency(): samples(0), slowest(0)
+  {
+    for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+      buckets[i] = 0;
+  }
+
+  void add(uint64_t value)
+  {
+    unsigned v = (value>0xffffffffULL)?0xffffffffU:(unsigned)value;
+    std::atomic<uint64_t> &b = buckets[KCHistogram::bucket(v)];
+
+    b.store(b.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    samples.store(samples.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    if (v>slowest.load(std::memory_order_relaxed))
+      slowest.store(v, std::memory_order_relaxed);
+  }
+
+  void snapshot(KCHistogram &histogram) const
+  {
+    for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+      {
+	uint64_t n = buckets[i].load(std::memory_order_relaxed);
+	if (n)
+	  histogram.add(KCHistogram::lowerBound(i), n);
+      }
+  }
+
+  uint64_t count() const
+  {
+    return samples.load(std::memory_order_relaxed);
+  }
+
+  unsigned highest() const
+  {
+    return slowest.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> buckets[KC_HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> samples;
+  std::atomic<unsigned> slowest;
+};
+
+static inline uint64_t monotonicNs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/* Adds the time it lives to a GLatency */
+class GLatencyTimer
+{
+public:
+  GLatencyTimer(GLatency &latency): latency(latency), start(monotonicNs())
+  {
+  }
+
+  ~GLatencyTimer()
+  {
+    latency.add(monotonicNs()-start);
+  }
+
+private:
+  GLatency &latency;
+  uint64_t start;
+};
+
+/* Where the recorder spends its time, see "keyCounter stats" */
+struct GRecorderStats
+{
+  GLatency capture;		/* A capture callback or input batch, ns */
+  GLatency keymap;		/* Loading key names from the server, ns */
+  GLatency monitor;		/* Counting a key press, ns */
+  GLatency store;		/* A whole commit, ns */
+  GLatency sync;		/* fdatasync() of a commit, ns */
+  GLatency rotate;		/* Starting a new log file, ns */
+  GLatency backlog;		/* Bytes waiting from XRecord when we wake up */
+  GLatency batch;		/* Events taken from the queue at once */
+  std::atomic<unsigned long> captured; /* Key presses seen */
+  std::atomic<unsigned long> skipped;  /* Other data from the server */
+  std::atomic<unsigned long> commits;
+  std::atomic<unsigned long> coalesced; /* Presses added to a key already pending */
+
+  GRecorderStats(): captured(0), skipped(0), commits(0), coalesced(0)
+  {
+  }
+
+  /* dropped: events lost because the queue was full */
+  void write(KCReport &report, unsigned long dropped) const
+  {
+    report.begin({ "stat", "count", "p50", "p90", "p99", "max" });
+    writeLatency(report, "capture_ns", capture);
+    writeLatency(report, "keymap_ns", keymap);
+    writeLatency(report, "monitor_ns", monitor);
+    writeLatency(report, "store_ns", store);
+    writeLatency(report, "sync_ns", sync);
+    writeLatency(report, "rotate_ns", rotate);
+    writeLatency(report, "xrecord_backlog_bytes", backlog);
+    writeLatency(report, "queue_batch_events", batch);
+    writeCounter(report, "captured", captured);
+    writeCounter(report, "dropped", dropped);
+    writeCounter(report, "skipped", skipped);
+    writeCounter(report, "commits", commits);
+    writeCounter(report, "coalesced", coalesced);
+    report.end();
+  }
+
+private:
+  static void writeLatency(KCReport &report, const char *name, const GLatency &latency)
+  {
+    KCHistogram histogram;
+    unsigned highest = latency.highest();
+
+    // Quantiles are the middle of a bucket, never above the highest
+    latency.snapshot(histogram);
+    report.field(name);
+    report.field((unsigned long)latency.count());
+    report.field((std::min)(histogram.quantile(0.5), highest));
+    report.field((std::min)(histogram.quantile(0.9), highest));
+    report.field((std::min)(histogram.quantile(0.99), highest));
+    report.field(highest);
+    report.endRow();
+  }
+
+  static void writeCounter(KCReport &report, const char *name, unsigned long value)
+  {
+    report.field(name);
+    report.field(value);
+    report.field("");
+    report.field("");
+    report.field("");
+    report.field("");
+    report.endRow();
+  }
+};
+
+/* Stats of the running recorder, kept by keyCounter.cpp */
+extern GRecorderStats recorderStats;
+
+#endif /* _KCSTATS_H */
@@ -0,0 +1,621 @@
+/**
+*************************************************************
+* @file kcsummary.cpp
+* @brief Mergeable analysis summaries
+*
+* Key counts, hourly presses and typing intervals of a data
+* set, which can be written, read and combined with others,
+* and presses by hour, day and week.
+*
+* @author Gaspar Fernández <blakeyed@totaki.com>
+* @version
+* @date 17 oct 2026
+*
+*************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include "cfileutils.h"
+#include "kcsegment.h"
+#include "kcsummary.h"
+
+using namespace std;
+
+KCHistogram::KCHistogram(): total(0)
+{
+  memset(buckets, 0, sizeof(buckets));
+}
+
+unsigned KCHistogram::bucket(unsigned value)
+{
+  unsigned exponent;
+
+  if (value<KC_HISTOGRAM_LINEAR)
+    return value;
+
+  exponent = 31-__builtin_clz(value);
+  return KC_HISTOGRAM_LINEAR+(exponent-6)*KC_HISTOGRAM_SUB+((value>>(exponent-4))&(KC_HISTOGRAM_SUB-1));
+}
+
+unsigned KCHistogram::lowerBound(unsigned bucket)
+{
+  unsigned exponent;
+
+  if (bucket<KC_HISTOGRAM_LINEAR)
+    return bucket;
+
+  bucket-=KC_HISTOGRAM_LINEAR;
+  exponent = bucket/KC_HISTOGRAM_SUB+6;
+  return (KC_HISTOGRAM_SUB+bucket%KC_HISTOGRAM_SUB)<<(exponent-4);
+}
+
+unsigned KCHistogram::upperBound(unsigned bucket)
+{
+  if (bucket+1>=KC_HISTOGRAM_BUCKETS)
+    return UINT_MAX;
+  return lowerBound(bucket+1)-1;
+}
+
+void KCHistogram::add(unsigned value, uint64_t times)
+{
+  buckets[bucket(value)]+=times;
+  total+=times;
+}
+
+void KCHistogram::merge(const KCHistogram &other)
+{
+  for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+    buckets[i]+=other.buckets[i];
+  total+=other.total;
+}
+
+unsigned KCHistogram::quantile(double q) const
+{
+  uint64_t rank, seen = 0;
+
+  if (total==0)
+    return 0;
+
+  rank = (uint64_t)ceil(q*total);
+  if (rank<1)
+    rank = 1;
+  for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+    {
+      seen+=buckets[i];
+      if (seen>=rank)
+	return lowerBound(i)+(upperBound(i)-lowerBound(i))/2;
+    }
+  return UINT_MAX;
+}
+
+void KCHistogram::serialize(string &out) const
+{
+  unsigned used = 0, previous = 0;
+
+  for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+    if (buckets[i])
+      used++;
+
+  kcPutVarint(out, used);
+  for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+    {
+      if (!buckets[i])
+	continue;
+      kcPutVarint(out, i-previous);
+      kcPutVarint(out, buckets[i]);
+      previous = i;
+    }
+}
+
+bool KCHistogram::unserialize(string_view data, size_t &pos)
+{
+  uint64_t used, delta, value, bucket = 0;
+
+  *this = KCHistogram();
+  if (!kcGetVarint(data, pos, used))
+    return false;
+  for (uint64_t i=0; i<used; ++i)
+    {
+      if ( (!kcGetVarint(data, pos, delta)) || (!kcGetVarint(data, pos, value)) ||
+	   ((bucket+=delta)>=KC_HISTOGRAM_BUCKETS) )
+	return false;
+      buckets[bucket] = value;
+      total+=value;
+    }
+  return true;
+}
+
+void KCInterval::add(unsigned seconds, time_t since)
+{
+  histogram.add(seconds);
+  if (!valid)
+    {
+      longest = shortest = seconds;
+      longestSince = shortestSince = since;
+      valid = true;
+      return;
+    }
+  if (seconds>longest)
+    {
+      longest = seconds;
+      longestSince = since;
+    }
+  if (seconds<shortest)
+    {
+      shortest = seconds;
+      shortestSince = since;
+    }
+}
+
+/* Ties keep the interval we already had, the earliest one if merged
+   in time order, as add() does */
+void KCInterval::merge(const KCInterval &other)
+{
+  histogram.merge(other.histogram);
+  if (!other.valid)
+    return;
+  if (!valid)
+    {
+      KCHistogram merged = histogram;
+      *this = other;
+      histogram = merged;
+      return;
+    }
+  if (other.longest>longest)
+    {
+      longest = other.longest;
+      longestSince = other.longestSince;
+    }
+  if (other.shortest<shortest)
+    {
+      shortest = other.shortest;
+      shortestSince = other.shortestSince;
+    }
+}
+
+unsigned KCInterval::quantile(double q) const
+{
+  unsigned value = histogram.quantile(q);
+
+  if (!valid)
+    return 0;
+  if (value<shortest)
+    return shortest;
+  if (value>longest)
+    return longest;
+  return value;
+}
+
+KCTimeline::KCTimeline(): base(0), dirty(false), leadHour(0), leadPresses(0)
+{
+}
+
+void KCTimeline::add(time_t hour, uint64_t presses)
+{
+  if (counts.empty())
+    base = hour;
+  else if (hour<base)
+    {
+      // Clocks may go back, make room before the first hour
+      counts.insert(counts.begin(), (base-hour)/3600, 0);
+      base = hour;
+    }
+
+  size_t index = (hour-base)/3600;
+  if (index>=counts.size())
+    counts.resize(index+1, 0);
+  counts[index]+=presses;
+  dirty = true;
+}
+
+void KCTimeline::lead(time_t hour, uint64_t presses)
+{
+  leadHour = hour;
+  leadPresses+=presses;
+}
+
+uint64_t KCTimeline::at(time_t hour) const
+{
+  uint64_t res = (hour==leadHour)?leadPresses:0;
+
+  if ( (counts.empty()) || (hour<base) || ((size_t)((hour-base)/3600)>=counts.size()) )
+    return res;
+  return res+counts[(hour-base)/3600];
+}
+
+void KCTimeline::sums() const
+{
+  if ( (!dirty) && (prefix.size()==counts.size()+1) )
+    return;
+
+  prefix.resize(counts.size()+1);
+  prefix[0] = 0;
+  for (size_t i=0; i<counts.size(); ++i)
+    prefix[i+1] = prefix[i]+counts[i];
+  dirty = false;
+}
+
+uint64_t KCTimeline::presses(time_t since, time_t until) const
+{
+  uint64_t res = densePresses(since, until);
+
+  if ( (leadPresses) && (leadHour>=3600*(since/3600)) && (leadHour<3600*(until/3600)) )
+    res+=leadPresses;
+  return res;
+}
+
+uint64_t KCTimeline::densePresses(time_t since, time_t until) const
+{
+  time_t end = base+(time_t)counts.size()*3600;
+  size_t from, to;
+
+  if ( (counts.empty()) || (until<=base) || (since>=end) )
+    return 0;
+
+  sums();
+  from = (since<=base)?0:(since-base)/3600;
+  to = (until>=end)?counts.size():(until-base)/3600;
+  return (to>from)?prefix[to]-prefix[from]:0;
+}
+
+map<time_t, unsigned> KCTimeline::hours() const
+{
+  map<time_t, unsigned> out;
+
+  for (size_t i=0; i<counts.size(); ++i)
+    if (counts[i])
+      out.emplace_hint(out.end(), base+(time_t)i*3600, counts[i]);
+  if (leadPresses)
+    out[leadHour]+=leadPresses;
+  return out;
+}
+
+/* Local midnight of the day (or Monday) of when, or the first hour
+   starting after it where time zones are not whole hours away from UTC,
+   so every hour goes to the day it starts in */
+static time_t localStart(time_t when, bool monday)
+{
+  struct tm tm;
+
+  localtime_r(&when, &tm);
+  if (monday)
+    tm.tm_mday-=(tm.tm_wday+6)%7;
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+  when = mktime(&tm);
+  return when+((3600-when%3600)%3600);
+}
+
+vector<pair<time_t, uint64_t> > KCTimeline::rollup(bool weekly) const
+{
+  vector<pair<time_t, uint64_t> > out;
+  time_t end = base+(time_t)counts.size()*3600;
+  struct tm tm;
+
+  for (time_t start = (counts.empty())?end:localStart(base, weekly); start<end; )
+    {
+      // Days are not always 24 hours long, mktime() knows
+      localtime_r(&start, &tm);
+      tm.tm_mday+=(weekly)?7:1;
+      tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+      tm.tm_isdst = -1;
+      time_t next = localStart(mktime(&tm), weekly);
+      if (next<=start)
+	next = start+3600;
+
+      uint64_t total = densePresses(start, next);
+      if (total)
+	out.push_back(make_pair(start, total));
+      start = next;
+    }
+
+  if (leadPresses)
+    {
+      pair<time_t, uint64_t> period(localStart(leadHour, weekly), 0);
+      // The hour may start before midnight when it's not a whole hour
+      if (period.first>leadHour)
+	{
+	  localtime_r(&leadHour, &tm);
+	  tm.tm_mday-=(weekly)?7:1;
+	  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	  tm.tm_isdst = -1;
+	  period.first = localStart(mktime(&tm), weekly);
+	}
+      vector<pair<time_t, uint64_t> >::iterator i = lower_bound(out.begin(), out.end(), period);
+      if ( (i==out.end()) || (i->first!=period.first) )
+	i = out.insert(i, period);
+      i->second+=leadPresses;
+    }
+  return out;
+}
+
+vector<pair<time_t, uint64_t> > KCTimeline::days() const
+{
+  return rollup(false);
+}
+
+vector<pair<time_t, uint64_t> > KCTimeline::weeks() const
+{
+  return rollup(true);
+}
+
+void KCTimeline::heatmap(uint64_t cells[7][24]) const
+{
+  struct tm tm;
+
+  memset(cells, 0, sizeof(uint64_t)*7*24);
+  for (size_t i=0; i<counts.size(); ++i)
+    {
+      if (!counts[i])
+	continue;
+      time_t hour = base+(time_t)i*3600;
+      localtime_r(&hour, &tm);
+      cells[(tm.tm_wday+6)%7][tm.tm_hour]+=counts[i];
+    }
+  if (leadPresses)
+    {
+      localtime_r(&leadHour, &tm);
+      cells[(tm.tm_wday+6)%7][tm.tm_hour]+=leadPresses;
+    }
+}
+
+bool KCSummary::append(const KCSummary &later)
+{
+  if ( (!chained) || (!later.chained) )
+    return false;
+
+  for (map<string, unsigned, less<> >::const_iterator i=later.keyTimes.begin(); i!=later.keyTimes.end(); ++i)
+    keyTimes[i->first]+=i->second;
+  for (map<time_t, unsigned>::const_iterator i=later.hourly.begin(); i!=later.hourly.end(); ++i)
+    hourly[i->first]+=i->second;
+
+  if (later.leadPresses)
+    {
+      if (hasHour)
+	hourly[lastHour]+=later.leadPresses;
+      else
+	leadPresses+=later.leadPresses;
+    }
+  if (later.hasHour)
+    {
+      hasHour = true;
+      lastHour = later.lastHour;
+    }
+
+  if (!(head&KC_HEAD_START))
+    {
+      // Nothing typed here, ends are the ones of the later data set.
+      // Only the first Stop without a Start counts, like in the analyzer
+      if ( (!(head&KC_HEAD_STOP)) && (later.head&KC_HEAD_STOP) )
+	{
+	  head|=KC_HEAD_STOP;
+	  headStop = later.headStop;
+	}
+      if (later.head&KC_HEAD_START)
+	{
+	  head|=KC_HEAD_START;
+	  headStart = later.headStart;
+	}
+      tail = later.tail;
+      tailSince = later.tailSince;
+    }
+  else
+    {
+      int state = tail;
+      time_t since = tailSince;
+
+      if ( (later.head&KC_HEAD_STOP) && (state==8) )
+	{
+	  writing.add(later.headStop-since, since);
+	  state = 7;
+	  since = later.headStop;
+	}
+      if ( (later.head&KC_HEAD_START) && (state==7) )
+	idle.add(later.headStart-since, since);
+
+      if (later.head&KC_HEAD_START)
+	{
+	  tail = later.tail;
+	  tailSince = later.tailSince;
+	}
+      else
+	{
+	  tail = state;
+	  tailSince = since;
+	}
+    }
+
+  writing.merge(later.writing);
+  idle.merge(later.idle);
+  return true;
+}
+
+void KCSummary::add(const KCSummary &other)
+{
+  for (map<string, unsigned, less<> >::const_iterator i=other.keyTimes.begin(); i!=other.keyTimes.end(); ++i)
+    keyTimes[i->first]+=i->second;
+  for (map<time_t, unsigned>::const_iterator i=other.hourly.begin(); i!=other.hourly.end(); ++i)
+    hourly[i->first]+=i->second;
+
+  leadPresses+=other.leadPresses;
+  writing.merge(other.writing);
+  idle.merge(other.idle);
+
+  chained = false;
+  head = tail = 0;
+  headStop = headStart = tailSince = 0;
+  hasHour = false;
+  lastHour = 0;
+}
+
+static void putInterval(string &out, const KCInterval &interval)
+{
+  out+=(char)interval.valid;
+  kcPutVarint(out, interval.longest);
+  kcPutZigzag(out, interval.longestSince);
+  kcPutVarint(out, interval.shortest);
+  kcPutZigzag(out, interval.shortestSince);
+  interval.histogram.serialize(out);
+}
+
+/* Version 1 summaries have no histograms */
+static bool getInterval(string_view data, size_t &pos, KCInterval &interval, int version)
+{
+  uint64_t longest, shortest;
+  int64_t longestSince, shortestSince;
+
+  if (pos>=data.size())
+    return false;
+  interval.valid = (data[pos++]!=0);
+  if ( (!kcGetVarint(data, pos, longest)) || (!kcGetZigzag(data, pos, longestSince)) ||
+       (!kcGetVarint(data, pos, shortest)) || (!kcGetZigzag(data, pos, shortestSince)) )
+    return false;
+
+  interval.longest = longest;
+  interval.longestSince = longestSince;
+  interval.shortest = shortest;
+  interval.shortestSince = shortestSince;
+  return ( (version<2) || (interval.histogram.unserialize(data, pos)) );
+}
+
+string KCSummary::serialize() const
+{
+  string out = KC_SUMMARY_MAGIC;
+  time_t previous = 0;
+  uint32_t crc;
+
+  out+=(char)KC_SUMMARY_VERSION;
+  out+=(char)((chained)?KC_SUMMARY_CHAINED:0);
+
+  kcPutVarint(out, keyTimes.size());
+  for (map<string, unsigned, less<> >::const_iterator i=keyTimes.begin(); i!=keyTimes.end(); ++i)
+    {
+      kcPutVarint(out, i->first.size());
+      out+=i->first;
+      kcPutVarint(out, i->second);
+    }
+  kcPutVarint(out, hourly.size());
+  for (map<time_t, unsigned>::const_iterator i=hourly.begin(); i!=hourly.end(); ++i)
+    {
+      kcPutZigzag(out, i->first-previous);
+      kcPutVarint(out, i->second);
+      previous = i->first;
+    }
+
+  putInterval(out, writing);
+  putInterval(out, idle);
+  out+=(char)head;
+  kcPutZigzag(out, headStop);
+  kcPutZigzag(out, headStart);
+  out+=(char)tail;
+  kcPutZigzag(out, tailSince);
+  kcPutVarint(out, leadPresses);
+  out+=(char)hasHour;
+  kcPutZigzag(out, lastHour);
+
+  crc = kcCrc32(out.data(), out.size());
+  for (int i=0; i<4; ++i)
+    out+=(char)((crc>>(8*i))&0xFF);
+  return out;
+}
+
+bool KCSummary::unserialize(string_view data)
+{
+  size_t pos = 5;
+  uint64_t count, len, value;
+  int64_t delta, since;
+  time_t hour = 0;
+  int version;
+  uint32_t crc = 0;
+
+  *this = KCSummary();
+  if ( (data.size()<9) || (data.compare(0, 3, KC_SUMMARY_MAGIC)!=0) ||
+       (data[3]<1) || (data[3]>KC_SUMMARY_VERSION) )
+    return false;
+  version = data[3];
+  for (int i=0; i<4; ++i)
+    crc|=(uint32_t)(unsigned char)data[data.size()-4+i]<<(8*i);
+  if (kcCrc32(data.data(), data.size()-4)!=crc)
+    return false;
+  data = data.substr(0, data.size()-4);
+  chained = (data[4]&KC_SUMMARY_CHAINED);
+
+  if (!kcGetVarint(data, pos, count))
+    return false;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if ( (!kcGetVarint(data, pos, len)) || (len>data.size()-pos) )
+	return false;
+      string_view name = data.substr(pos, len);
+      pos+=len;
+      if (!kcGetVarint(data, pos, value))
+	return false;
+      keyTimes.emplace(name, value);
+    }
+
+  if (!kcGetVarint(data, pos, count))
+    return false;
+  for (uint64_t i=0; i<count; ++i)
+    {
+      if ( (!kcGetZigzag(data, pos, delta)) || (!kcGetVarint(data, pos, value)) )
+	return false;
+      hour+=delta;
+      hourly.emplace_hint(hourly.end(), hour, value);
+    }
+
+  if ( (!getInterval(data, pos, writing, version)) || (!getInterval(data, pos, idle, version)) ||
+       (pos>=data.size()) )
+    return false;
+  head = (unsigned char)data[pos++];
+  if (!kcGetZigzag(data, pos, since))
+    return false;
+  headStop = since;
+  if ( (!kcGetZigzag(data, pos, since)) || (pos>=data.size()) )
+    return false;
+  headStart = since;
+  tail = (unsigned char)data[pos++];
+  if (!kcGetZigzag(data, pos, since))
+    return false;
+  tailSince = since;
+  if ( (!kcGetVarint(data, pos, value)) || (pos>=data.size()) )
+    return false;
+  leadPresses = value;
+  hasHour = (data[pos++]!=0);
+  if (!kcGetZigzag(data, pos, since))
+    return false;
+  lastHour = since;
+
+  return (pos==data.size());
+}
+
+bool KCSummary::save(const string &path) const
+{
+  string temp = path+".tmp";
+  ofstream of(temp.c_str(), ios::trunc | ios::binary);
+
+  if (!of.is_open())
+    return false;
+  of << serialize();
+  of.close();
+
+  return ( (!of.fail()) && (rename(temp.c_str(), path.c_str())==0) );
+}
+
+int KCSummary::load(const string &path)
+{
+  const char *data;
+  long long size;
+  bool ok;
+
+  size = file_map(&data, path.c_str());
+  if (size<0)
+    return -1;
+
+  ok = unserialize(string_view(data, size));
+  file_unmap(data, size);
+  return (ok)?0:-2;
+}
@@ -0,0 +1,239 @@
+/* @(#)kcsummary.h
+ */
+
+#ifndef _KCSUMMARY_H
+#define _KCSUMMARY_H 1
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+#include <ctime>
+#include <stdint.h>
+
+/*
+ * Summary file layout:
+ *
+ *   "KCS" version(1 byte) flags(1 byte, bit 0: chained)
+ *   varint(key count)  { varint(length) name varint(presses) }
+ *   varint(hour count) { zigzag(hour - previous hour) varint(presses) }
+ *   writing interval, idle interval:
+ *                      valid(1 byte) varint(longest) zigzag(since)
+ *                      varint(shortest) zigzag(since)
+ *                      histogram (version 2): varint(used buckets)
+ *                      { varint(bucket - previous bucket) varint(count) }
+ *   head:              flags(1 byte, bit 0: stop, bit 1: start)
+ *                      zigzag(stop) zigzag(start)
+ *   tail:              state(1 byte, 0, 7 or 8) zigzag(since)
+ *   varint(lead presses) hasHour(1 byte) zigzag(last hour)
+ *   crc32(everything before, 4 bytes LE)
+ */
+
+#define KC_SUMMARY_MAGIC "KCS"
+#define KC_SUMMARY_VERSION 2
+#define KC_SUMMARY_CHAINED 1
+
+#define KC_HEAD_STOP 1
+#define KC_HEAD_START 2
+
+#define KC_HISTOGRAM_LINEAR 64	/* Exact buckets for the smallest values */
+#define KC_HISTOGRAM_SUB 16	/* Buckets for every power of two after them */
+#define KC_HISTOGRAM_BUCKETS (KC_HISTOGRAM_LINEAR+(32-6)*KC_HISTOGRAM_SUB)
+
+/**
+ * Log bucketed histogram of durations in seconds (or milliseconds between
+ * keys): exact up to 63 and 16 buckets for every power of two after
+ * that, so any quantile is off by 3% at most. It takes the same memory
+ * whatever the number of values and two histograms can be added.
+ */
+class KCHistogram
+{
+public:
+  KCHistogram();
+
+  void add(unsigned value, uint64_t times=1);
+  void merge(const KCHistogram &other);
+
+  uint64_t count() const
+  {
+    return total;
+  }
+
+  /**
+   * @param q quantile, from 0 to 1
+   *
+   * @return value at that quantile (the middle of its bucket), 0 if
+   *         empty
+   */
+  unsigned quantile(double q) const;
+
+  uint64_t at(unsigned bucket) const
+  {
+    return buckets[bucket];
+  }
+
+  /* Bucket of a value */
+  static unsigned bucket(unsigned value);
+
+  /* Smallest value of a bucket */
+  static unsigned lowerBound(unsigned bucket);
+
+  /* Biggest value of a bucket */
+  static unsigned upperBound(unsigned bucket);
+
+  void serialize(std::string &out) const;
+  bool unserialize(std::string_view data, size_t &pos);
+
+private:
+  uint64_t buckets[KC_HISTOGRAM_BUCKETS];
+  uint64_t total;
+};
+
+/* Longest and shortest of a kind of interval (typing or idle), and how
+   long they are */
+struct KCInterval
+{
+  bool valid;			/* We have seen at least one */
+  unsigned longest, shortest;
+  time_t longestSince, shortestSince;
+  KCHistogram histogram;
+
+  KCInterval(): valid(false), longest(0), shortest(0), longestSince(0), shortestSince(0)
+  {
+  }
+
+  void add(unsigned seconds, time_t since);
+  void merge(const KCInterval &other);
+
+  /* Quantile from the histogram, never out of the values seen */
+  unsigned quantile(double q) const;
+};
+
+/**
+ * Key presses by hour, in a dense array from the first hour seen, so
+ * adding presses is an index and years of data are a few hundred Kb.
+ * Prefix sums, built when first needed after adding, give the presses
+ * of any time window in constant time, and whole days and weeks (local
+ * time) are added from them.
+ */
+class KCTimeline
+{
+public:
+  KCTimeline();
+
+  /* hour must be a multiple of 3600 */
+  void add(time_t hour, uint64_t presses);
+
+  /* Presses before the first save, reported at hour as nothing better
+     is known (as KCSummary::leadPresses). They are kept apart, so an
+     hour far from the rest doesn't stretch the array */
+  void lead(time_t hour, uint64_t presses);
+
+  bool empty() const
+  {
+    return ( (counts.empty()) && (!leadPresses) );
+  }
+
+  uint64_t at(time_t hour) const;
+
+  /* Presses from the hour of since to the hour before the one of until */
+  uint64_t presses(time_t since, time_t until) const;
+
+  /* Hours with presses, as summaries keep them */
+  std::map<time_t, unsigned> hours() const;
+
+  /* (local midnight, presses) of every day, or week starting on Monday,
+     with presses */
+  std::vector<std::pair<time_t, uint64_t> > days() const;
+  std::vector<std::pair<time_t, uint64_t> > weeks() const;
+
+  /* Presses by local day of the week (0 is Monday) and hour */
+  void heatmap(uint64_t cells[7][24]) const;
+
+private:
+  time_t base;			/* Hour of counts[0] */
+  std::vector<uint64_t> counts;
+  mutable std::vector<uint64_t> prefix; /* prefix[i]: presses before counts[i] */
+  mutable bool dirty;
+  time_t leadHour;
+  uint64_t leadPresses;
+
+  void sums() const;
+  uint64_t densePresses(time_t since, time_t until) const;
+  std::vector<std::pair<time_t, uint64_t> > rollup(bool weekly) const;
+};
+
+/**
+ * Everything an analysis finds in a data set, small enough to be sent
+ * anywhere and combined with other summaries.
+ *
+ * Typing intervals crossing the limits of the data set can't be known
+ * from inside it, so the summary also keeps what happens at both ends:
+ * the head (a Stop before any Start, and the first Start, whose idle
+ * time before it is unknown) and the tail (typing or idle since when).
+ * Key presses before the first save belong to the last hour of the
+ * previous data set, they are kept apart as lead presses.
+ */
+struct KCSummary
+{
+  std::map<std::string, unsigned, std::less<> > keyTimes;
+  std::map<time_t, unsigned> hourly;
+  KCInterval writing;
+  KCInterval idle;
+  int head;			/* KC_HEAD_STOP | KC_HEAD_START */
+  time_t headStop, headStart;
+  int tail;			/* 0 unknown, 7 stopped, 8 typing */
+  time_t tailSince;
+  unsigned leadPresses;
+  bool hasHour;			/* lastHour is known */
+  time_t lastHour;
+  bool chained;			/* Ends can still be joined to other data sets */
+
+  KCSummary(): head(0), headStop(0), headStart(0), tail(0), tailSince(0), leadPresses(0),
+	       hasHour(false), lastHour(0), chained(true)
+  {
+  }
+
+  /**
+   * Adds the summary of the data set right after this one (the same
+   * user, later in time), joining the typing intervals between both.
+   * a.append(b), then c is the same as a.append(b.append(c)).
+   *
+   * @param later following summary
+   *
+   * @return false if any of them is not chained (see add())
+   */
+  bool append(const KCSummary &later);
+
+  /**
+   * Adds the summary of an unrelated data set (i.e. another user). The
+   * result can't be appended to, nor appended anymore.
+   *
+   * @param other summary to add
+   */
+  void add(const KCSummary &other);
+
+  std::string serialize() const;
+
+  /**
+   * @param data serialized summary
+   *
+   * @return false if it's not a summary or it is corrupt
+   */
+  bool unserialize(std::string_view data);
+
+  /**
+   * Writes the summary to a temporary file and renames it
+   *
+   * @return false on error
+   */
+  bool save(const std::string &path) const;
+
+  /**
+   * @return 0 on success, -1 if the file can't be read, -2 if it's not
+   *         a valid summary
+   */
+  int load(const std::string &path);
+};
+
+#endif /* _KCSUMMARY_H */
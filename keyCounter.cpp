@@ -13,16 +13,29 @@
 *   - x11proto-record-dev
 *
 * Compile:
-*   - g++ -o keyCounter keyCounter.cpp cfileutils.cpp -lX11 -lXtst
+*   - make
 *************************************************************/
 
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
 #include <vector>
+#include <array>
+#include <charconv>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <ctime>
+#include <cstring>
 #include <unistd.h>
 #include <X11/Xlibint.h>
 #include <X11/Xlib.h>
@@ -32,34 +45,47 @@
 #include <X11/keysym.h>
 #include <X11/extensions/record.h>
 #include "cfileutils.h"
+#include "kcsegment.h"
+#include "eventring.h"
+#include "kcreport.h"
+#include "kcgenerate.h"
+#include "kcsummary.h"
+#include "kcsequence.h"
+#include "kcscan.h"
+#include "kcstats.h"
+#include "kcinput.h"
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <ftw.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <glob.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define DEFAULT_MAX_IDLE_TIME 15
 #define DEFAULT_MIN_STORE_TIME 120
 #define DEFAULT_MAX_FILE_SIZE 100000
-#define EXIT_ON_ESCAPE 0
+#define DEFAULT_ROLLUP_SIZE (16*1024*1024)
+#define DEFAULT_COMPACT_AGE 86400	/* Only compact segments older than this */
+#define COMPACT_INTERVAL 21600		/* Recorder compacts every 6 hours */
 
-using namespace std;
-
-int Exit_signal = 0;
+#define EVENT_RING_SIZE 4096
+#define QUERY_TIMEOUT 1000		/* ms a query client has, to ask and read */
+#define QUERY_CLIENTS 8			/* Query clients served at once */
 
-typedef struct
-{
-  int Status1, Status2, x, y, mmoved, doit;
-  unsigned int QuitKey;
-  Display *LocalDpy, *RecDpy;
-  XRecordContext rc;
-} Priv;
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
 
-string itoa(int i)
-{
-  stringstream ss;
-  ss<<i;
-  
-  return ss.str();
-}
+using namespace std;
 
 string strtime(time_t timestamp, string format)
 {
@@ -96,602 +122,4208 @@ string trim( std::string str, const std::string& trimChars = whiteSpaces )
    return str;
 }
 
-void criticalError(string msg)
+[[noreturn]] void criticalError(string msg)
 {
   cerr << "Error: "<< msg << endl;
   exit ( EXIT_FAILURE );
 }
 
-string getKeysymStr(Priv *p, unsigned int key)
+/* Data directory given with --dir, ~/.keyCounter if none. The recorder
+   keeps its socket, sequences and caches next to it, <dir>.sock... */
+string dataDirectory(const string &dir)
 {
-    int kpkr;
-    string res;
+  return (dir.empty())?(string)getHomeDir()+"/.keyCounter":dir;
+}
 
-    KeySym *keysym = XGetKeyboardMapping(p->LocalDpy,
-        key,
-        1,
-        &kpkr);
+/* Hour key used for presses found before the first save mark of a file,
+   they belong to the last hour of the previous file */
+#define KC_INHERIT_HOUR ((time_t)-1)
 
-    res = XKeysymToString(keysym[0]);
-    /* do something with keysym[0] */
+/* Time range of a query, saves outside it are ignored */
+struct KCTimeRange
+{
+  time_t since;
+  time_t until;
 
-    XFree(keysym);
-    return res;
-}
+  KCTimeRange(): since(0), until((numeric_limits<time_t>::max)())
+  {
+  }
 
-class KCAnalyzer
-{
-public:
-  KCAnalyzer()
+  bool all() const
   {
+    return ( (since==0) && (until==(numeric_limits<time_t>::max)()) );
   }
-  ~KCAnalyzer()
+
+  bool contains(time_t when) const
   {
+    return ( (when>=since) && (when<=until) );
   }
+};
+
+#define KC_INDEX_MAGIC "KCI"
+#define KC_INDEX_VERSION 1
 
-  string keycount()
+/* Sidecar index of a text segment: the offset of every save mark, so a
+   time range query can jump to the first block it needs. Indexes live
+   in their own directory and are rebuilt when the segment changes */
+class KCSeekIndex
+{
+public:
+  /* Offset of the first save mark at or after since, 0 if unknown */
+  static size_t find(const string &segment, string_view data, const string &indexDir, time_t since)
   {
-    string s;
-    this->getStats();
+    vector<pair<time_t, size_t> > entries;
+    struct stat sinfo;
+    long long mtime;
+    string path;
+
+    if ( (indexDir.empty()) || (stat(segment.c_str(), &sinfo)<0) )
+      return 0;
 
-    for (map<string, unsigned>::iterator i=keyTimes.begin(); i!=keyTimes.end(); ++i)
+    mtime = sinfo.st_mtim.tv_sec*1000000000LL+sinfo.st_mtim.tv_nsec;
+    path = indexDir+"/"+segment.substr(segment.rfind('/')+1)+".idx";
+    if (!load(path, data.size(), mtime, entries))
       {
-    	s+=(string)i->first+";"+(string)itoa(i->second)+"\n";
+	if (!build(data, entries))
+	  return 0;
+	if (directory_exists(indexDir.c_str())==0)
+	  createDir(indexDir.c_str(), 0744);
+	save(path, data.size(), mtime, entries);
       }
-    return s;
+
+    vector<pair<time_t, size_t> >::iterator i =
+      lower_bound(entries.begin(), entries.end(), make_pair(since, (size_t)0));
+    return (i==entries.end())?data.size():i->second;
   }
 
-  string burst()
+private:
+  /* Fails if saves are not in order, we couldn't binary search them */
+  static bool build(string_view data, vector<pair<time_t, size_t> > &entries)
   {
-    string s;
-    this->getStats();
+    size_t pos = 0;
+    string_view keysym;
+    int value;
 
-    s=start_stop_history;
-    cerr << "Max writing time: "<<max_writing<<"s since "<<strtime(max_writing_timestamp, "%d/%m/%Y %H:%M")<<endl;
-    cerr << "Max idle time: "<<max_stopped<< "s since "<<strtime(max_stopped_timestamp, "%d/%m/%Y %H:%M")<<endl;
-    cerr << "Min writing time: "<<min_writing<<"s since "<<strtime(min_writing_timestamp, "%d/%m/%Y %H:%M")<<endl;
-    cerr << "Min idle time: "<<min_stopped<< "s since "<<strtime(min_stopped_timestamp, "%d/%m/%Y %H:%M")<<endl;
+    while (pos<data.size())
+      {
+	size_t eol = data.find('\n', pos);
+	if (eol==string_view::npos)
+	  eol = data.size();
 
-    return s;
+	if ( (data[pos]=='9') && (splitStatLine(data.substr(pos, eol-pos), keysym, value)==9) )
+	  {
+	    if ( (!entries.empty()) && (entries.back().first>(time_t)(size_t)value) )
+	      return false;
+	    entries.push_back(make_pair((time_t)(size_t)value, pos));
+	  }
+	pos = eol+1;
+      }
+    return true;
   }
 
-  string hourlyLog()
+  static bool load(const string &path, long long size, long long mtime, vector<pair<time_t, size_t> > &entries)
   {
-    string s;
-    this->getStats();
+    const char *data;
+    long long fsize;
+    size_t pos = 4;
+    uint64_t value, count, offset = 0;
+    int64_t delta, when = 0;
+    bool ok = false;
+
+    fsize = file_map(&data, path.c_str());
+    if (fsize<8)
+      {
+	file_unmap(data, fsize);
+	return false;
+      }
+
+    string_view buffer(data, fsize-4);
+    uint32_t crc = 0;
+    for (int i=0; i<4; ++i)
+      crc|=(uint32_t)(unsigned char)data[fsize-4+i]<<(8*i);
 
-    for (map<time_t, unsigned>::iterator i=hourly.begin(); i!=hourly.end(); ++i)
+    if ( (buffer.compare(0, 3, KC_INDEX_MAGIC)==0) && (buffer[3]==KC_INDEX_VERSION) &&
+	 (kcCrc32(data, fsize-4)==crc) && (kcGetVarint(buffer, pos, value)) && ((long long)value==size) &&
+	 (kcGetVarint(buffer, pos, value)) && ((long long)value==mtime) && (kcGetVarint(buffer, pos, count)) )
       {
-	cout << itoa(i->first)<<";"<<strtime(i->first, "%d/%m/%Y %H:%M")<<";"<<i->second<<endl;
+	ok = true;
+	for (uint64_t i=0; (ok) && (i<count); ++i)
+	  {
+	    ok = ( (kcGetZigzag(buffer, pos, delta)) && (kcGetVarint(buffer, pos, value)) );
+	    when+=delta;
+	    offset+=value;
+	    entries.push_back(make_pair((time_t)when, (size_t)offset));
+	  }
       }
+    file_unmap(data, fsize);
 
-    return s;
+    if (!ok)
+      entries.clear();
+    return ok;
   }
 
-private:
-  vector <string> fileList;
-  map<string, unsigned> keyTimes;
-  map<time_t, unsigned> hourly;
-  int state;
-  time_t last_started, last_stopped, last_saved;
-  unsigned max_writing, max_stopped;
-  unsigned min_writing, min_stopped;
-  time_t max_writing_timestamp;
-  time_t max_stopped_timestamp;
-  time_t min_writing_timestamp;
-  time_t min_stopped_timestamp;
-  string start_stop_history;
-  time_t current_time;
-
-  bool parseKeyPress(string line, int offset)
+  static void save(const string &path, long long size, long long mtime, const vector<pair<time_t, size_t> > &entries)
   {
-    size_t pos, pos2;
-    string keysym;
-    int times;
+    string out = KC_INDEX_MAGIC;
+    string temp = path+".tmp";
+    time_t when = 0;
+    size_t offset = 0;
+    uint32_t crc;
 
-    pos = line.find('(', offset);
-    pos2 = line.find(')', pos);
-
-    if ( (pos==string::npos) || (pos2==string::npos) )
-      return false;
-    keysym = line.substr(pos+1, pos2-pos-1);
-
-    pos= line.find(':', pos2);
-    if (pos==string::npos)
-      return false;
+    out+=(char)KC_INDEX_VERSION;
+    kcPutVarint(out, size);
+    kcPutVarint(out, mtime);
+    kcPutVarint(out, entries.size());
+    for (unsigned i=0; i<entries.size(); ++i)
+      {
+	kcPutZigzag(out, entries[i].first-when);
+	kcPutVarint(out, entries[i].second-offset);
+	when = entries[i].first;
+	offset = entries[i].second;
+      }
+    crc = kcCrc32(out.data(), out.size());
+    for (int i=0; i<4; ++i)
+      out+=(char)((crc>>(8*i))&0xFF);
 
-    times = atoi(trim(line.substr(pos+1)).c_str());
-    hourly[current_time]+=times;
-    keyTimes[keysym]+=times;
-    return true;
+    ofstream of(temp.c_str(), ios::trunc | ios::binary);
+    if (!of.is_open())
+      return;
+    of << out;
+    of.close();
+    if (!of.fail())
+      rename(temp.c_str(), path.c_str());
   }
+};
 
-  bool parseTime(string line, int offset, size_t &time)
-  {
-    size_t pos = line.find(':');
-    if (pos==string::npos)
-      return false;
+/* Everything a single log file contributes to the analysis. Files are
+   parsed independently, typing start/stop marks are kept in order so
+   the burst state machine can be replayed across file boundaries. */
+struct KCFileStats
+{
+  string name;
+  bool ok;
+  map<string, unsigned, less<> > keyTimes;
+  map<time_t, unsigned> hourly;
+  vector<pair<int, time_t> > typing; /* (7 stop | 8 start, timestamp) */
+  vector<string> errors;
+  time_t current_time;		     /* Last hour seen, or KC_INHERIT_HOUR */
+  time_t last_saved;
 
-    time = atoi(trim(line.substr(pos+1)).c_str());
-    return true;
-  }
+  bool partial;			     /* Only part of it is in the query range */
 
-  bool parseSaveState(string line, int offset)
+  KCFileStats(): ok(false), current_time(KC_INHERIT_HOUR), last_saved(0), partial(false)
   {
-    size_t time;
-    if (!parseTime(line, offset, time))
-      return false;
-
-    current_time = 3600* (time/3600);
-    last_saved=time;
-    return true;
   }
 
-  bool parseStartTyping(string line, int offset)
+  /* Everything but the name, to be stored in the summary cache */
+  void serialize(string &out) const
   {
-    size_t time;
-    size_t diff;
-    if (!parseTime(line, offset, time))
-      return false;
+    kcPutVarint(out, keyTimes.size());
+    for (map<string, unsigned, less<> >::const_iterator i=keyTimes.begin(); i!=keyTimes.end(); ++i)
+      {
+	kcPutVarint(out, i->first.size());
+	out+=i->first;
+	kcPutVarint(out, i->second);
+      }
 
-    if (!(state&8))
+    kcPutVarint(out, hourly.size());
+    for (map<time_t, unsigned>::const_iterator i=hourly.begin(); i!=hourly.end(); ++i)
       {
-	if (state&4)		// It has been stopped at least once
-	  {
-	    diff = time-last_stopped;
-	    start_stop_history+="Stop;"+itoa(last_stopped)+";"+itoa(diff)+"\n";
-	    if (!(state&1))	// Don't have max && min time stopped
-	      {
-		max_stopped=diff;
-		min_stopped=diff;
-		max_stopped_timestamp=last_stopped;
-		min_stopped_timestamp=last_stopped;
-		state+=1;
-	      }
-	    else
-	      {
-		if (diff>max_stopped)
-		  {
-		    max_stopped=diff;
-		    max_stopped_timestamp=last_stopped;
-		  }
-		if (diff<min_stopped)
-		  {
-		    min_stopped=diff;
-		    min_stopped_timestamp=last_stopped;
-		  }
-	      }
-	  }
+	kcPutZigzag(out, i->first);
+	kcPutVarint(out, i->second);
+      }
 
-	last_started=time;
-	state+=8;
+    kcPutVarint(out, typing.size());
+    for (unsigned i=0; i<typing.size(); ++i)
+      {
+	out+=(char)typing[i].first;
+	kcPutZigzag(out, typing[i].second);
       }
-    else
+
+    kcPutVarint(out, errors.size());
+    for (unsigned i=0; i<errors.size(); ++i)
       {
-	cerr << "Caution, we have just started typing... possible bug"<<endl;
+	kcPutVarint(out, errors[i].size());
+	out+=errors[i];
       }
-    return true;
+
+    kcPutZigzag(out, current_time);
+    kcPutZigzag(out, last_saved);
   }
 
-  bool parseStopTyping(string line, int offset)
+  bool unserialize(string_view data)
   {
-    size_t time;
-    size_t diff;
+    size_t pos = 0;
+    uint64_t count, len, value;
+    int64_t when;
 
-    if (!parseTime(line, offset, time))
+    if (!kcGetVarint(data, pos, count))
       return false;
-
-    if (state&8)		// Typing started
+    for (uint64_t i=0; i<count; ++i)
       {
-	if (!(state&4))		// First time stopped
-	  state+=4;
-	
-	diff=time-last_started;
-	start_stop_history+="Start;"+itoa(last_started)+";"+itoa(diff)+"\n";
-	if (!(state&2))		// Dont have max && min time writing
-	  {
-	    max_writing=diff;
-	    min_writing=diff;
-	    max_writing_timestamp=last_started;
-	    min_writing_timestamp=last_started;
-	    state+=2;
-	    
-	  }
-	else
-	  {
-	    if (diff>max_writing)
-	      {
-		max_writing=diff;
-		max_writing_timestamp=last_started;
-	      }
-	    if (diff<min_writing)
-	      {
-		min_writing=diff;
-		min_writing_timestamp=last_started;
-	      }
-
-	  }
-
-	last_stopped=time;
-	state-=8;
+	if ( (!kcGetVarint(data, pos, len)) || (len>data.size()-pos) )
+	  return false;
+	string key(data.substr(pos, len));
+	pos+=len;
+	if (!kcGetVarint(data, pos, value))
+	  return false;
+	keyTimes[key] = value;
       }
-    else
+
+    if (!kcGetVarint(data, pos, count))
+      return false;
+    for (uint64_t i=0; i<count; ++i)
       {
-	cerr << "Caution! Typing is already stopped... possible bug"<<endl;
+	if ( (!kcGetZigzag(data, pos, when)) || (!kcGetVarint(data, pos, value)) )
+	  return false;
+	hourly[when] = value;
       }
-    return true;
-  }
-
-  bool parseStatLine(string line)
-  {
-    size_t pos;
-    int command;
 
-    pos = line.find(' ');
-    if (pos==string::npos)
+    if (!kcGetVarint(data, pos, count))
       return false;
-    
-    command = atoi(line.substr(0, pos).c_str());
-    switch (command)
+    for (uint64_t i=0; i<count; ++i)
       {
-      case 1:
-	return parseKeyPress(line, pos);
-      case 7:
-	return parseStopTyping(line, pos);
-      case 8:
-	return parseStartTyping(line, pos);
-      case 9:
-	return parseSaveState(line, pos);
-      default:
-	return false;
+	if (pos>=data.size())
+	  return false;
+	int kind = data[pos++];
+	if (!kcGetZigzag(data, pos, when))
+	  return false;
+	typing.push_back(make_pair(kind, (time_t)when));
       }
-  }
-
-  void getStats()
-  {
-    string line;
 
-    this->state=0;
-    generateFileList();
-    for (unsigned i = 0; i<fileList.size(); ++i)
+    if (!kcGetVarint(data, pos, count))
+      return false;
+    for (uint64_t i=0; i<count; ++i)
       {
-	cout << "Reading "<<fileList[i]<<endl;
-	ifstream ifs;
-	ifs.open(fileList[i].c_str());
-	if (!ifs.is_open())
-	  {
-	    cerr << "Skipping "+fileList[i]<<endl;
-	    continue;
-	  }
-	cout << "read lines..."<<endl;
-	while (!ifs.eof())
-	  {
-	    getline(ifs, line);
-	    if ( (!this->parseStatLine(line)) && (!line.empty()))
-	      cerr << "Wrong data line: \""+line+"\""<<endl;
-	  }
+	if ( (!kcGetVarint(data, pos, len)) || (len>data.size()-pos) )
+	  return false;
+	errors.push_back(string(data.substr(pos, len)));
+	pos+=len;
       }
-  }
-
-  void generateFileList()
-  {
-    if (fileList.size()!=0)
-      return;
 
-    string origin = getHomeDir();
-    origin+="/.keyCounter";
-
-    if (directory_exists(origin.c_str())<1)
-      criticalError("No data to analyze");
-
-    DIR *dir;
-    struct dirent *ent;
-
-    dir = opendir (origin.c_str());
+    if (!kcGetZigzag(data, pos, when))
+      return false;
+    current_time = when;
+    if (!kcGetZigzag(data, pos, when))
+      return false;
+    last_saved = when;
 
-    if (dir == NULL) 
-      criticalError("Can't open log directory");
-  
-    while ((ent = readdir (dir)) != NULL) 
-      {
-	/* Nos devolverá el directorio actual (.) y el anterior (..), como hace ls */
-	if ( (strcmp(ent->d_name, ".")!=0) && (strcmp(ent->d_name, "..")!=0) )
-	  {
-	    fileList.push_back(origin+(string)"/"+ent->d_name);
-	  }
-      }
-    closedir (dir);
+    ok = true;
+    return true;
   }
 };
 
-class GEventRecorder
+#define KC_CACHE_MAGIC "KCC"
+#define KC_CACHE_VERSION 1
+
+/* Summaries of the segments already parsed, so they don't have to be
+   parsed again until their size or modification time change. Closed
+   segments never change, so only the new ones and the one being
+   recorded are read again. Entries not used in a run are dropped when
+   saving, as their segments are gone */
+class KCSummaryCache
 {
 public:
-  static GEventRecorder* getInstance()
+  KCSummaryCache(const string &path): path(path), dirty(false)
   {
-    if (instance==NULL)
-      instance=new GEventRecorder();
-
-    return instance;
   }
 
-  void monitorKey(int action, string keysymStr)
+  /* A missing or corrupt cache is just an empty one */
+  void load()
   {
-    time_t tstamp = time(NULL);
-    if (lastTimestamp+this->maxIdleTime<tstamp)
+    const char *data;
+    long long size;
+    size_t pos = 4;
+    uint64_t count, len, fsize, mtime;
+
+    size = file_map(&data, path.c_str());
+    if (size<=0)
+      return;
+
+    string_view buffer(data, size);
+    if ( (size<8) || (buffer.compare(0, 3, KC_CACHE_MAGIC)!=0) || (buffer[3]!=KC_CACHE_VERSION) ||
+	 (kcCrc32(data, size-4)!=readCrc(buffer.substr(size-4))) )
       {
-    	if (lastTimestamp!=0)
-    	  intervalLog+="7 Stop typing: "+itoa(lastTimestamp)+"\n";
-    	intervalLog+="8 Start typing: "+itoa(tstamp)+"\n";
+	file_unmap(data, size);
+	dirty = true;
+	return;
       }
-    keyTimes[keysymStr]++;
-    lastTimestamp=tstamp;
-    storeData();
-  }
+    buffer = buffer.substr(0, size-4);
 
-private:
-  static GEventRecorder *instance;
-  time_t lastTimestamp;
-  time_t lastStore;
-  string logPath;
-  map<string, unsigned> keyTimes;
-  string intervalLog;
-  string currentFile;
+    if (kcGetVarint(buffer, pos, count))
+      {
+	for (uint64_t i=0; i<count; ++i)
+	  {
+	    if ( (!kcGetVarint(buffer, pos, len)) || (len>buffer.size()-pos) )
+	      break;
+	    string name(buffer.substr(pos, len));
+	    pos+=len;
+	    if ( (!kcGetVarint(buffer, pos, fsize)) || (!kcGetVarint(buffer, pos, mtime)) ||
+		 (!kcGetVarint(buffer, pos, len)) || (len>buffer.size()-pos) )
+	      break;
 
-  unsigned maxIdleTime;
-  unsigned minStoreTime;
-  unsigned maxFileSize;
+	    Entry &entry = entries[name];
+	    entry.size = fsize;
+	    entry.mtime = mtime;
+	    entry.data = string(buffer.substr(pos, len));
+	    entry.used = false;
+	    pos+=len;
+	  }
+      }
+    file_unmap(data, size);
+  }
 
-  GEventRecorder()
+  /* Fills stats (by its name) if we have an up to date summary */
+  bool find(KCFileStats &stats, long long size, long long mtime)
   {
-    short result;
+    map<string, Entry>::iterator i = entries.find(stats.name);
 
-    // Configuration... already manual
-    maxIdleTime = DEFAULT_MAX_IDLE_TIME;
-    minStoreTime = DEFAULT_MIN_STORE_TIME;
-    maxFileSize = DEFAULT_MAX_FILE_SIZE;
+    if ( (i==entries.end()) || (i->second.size!=size) || (i->second.mtime!=mtime) )
+      return false;
 
-    cerr << "Searching path..." << endl;
-    logPath = getHomeDir();
-    logPath+="/.keyCounter";
-    result = directory_exists(logPath.c_str());
-    if (result<0)
-      criticalError("Error getting log directory");
-    else if(result==0)
+    if (!stats.unserialize(i->second.data))
       {
-	if (createDir (logPath.c_str(), 0744)<0)
-	  criticalError("Error creating log directory");
+	stats = KCFileStats();
+	return false;
       }
 
-    createNewFile();
-    lastTimestamp = 0;
-    lastStore = time(NULL);
+    i->second.used = true;
+    return true;
   }
 
-  ~GEventRecorder()
+  /* Segment still exists but wasn't read in this run */
+  void keep(const string &name)
   {
+    map<string, Entry>::iterator i = entries.find(name);
+
+    if (i!=entries.end())
+      i->second.used = true;
   }
 
-  string keyDebug()
+  void store(const KCFileStats &stats, long long size, long long mtime)
   {
-    stringstream ss;
-    for (map<string,unsigned>::iterator i=keyTimes.begin(); i!=keyTimes.end(); ++i)
-      ss << "1 Press ("<<i->first<<") : "<<i->second<<endl;
+    Entry &entry = entries[stats.name];
 
-    return ss.str();
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.data.clear();
+    stats.serialize(entry.data);
+    entry.used = true;
+    dirty = true;
   }
 
-  void storeData()
+  /* Writes the cache if it changed. It's written to a temporary file
+     first so a crash never leaves a half written cache */
+  bool save()
   {
-    time_t current = time(NULL);
-    ofstream of;
+    string out = KC_CACHE_MAGIC;
+    string temp = path+".tmp";
+    uint32_t crc;
+    uint64_t count = 0;
 
-    if (lastStore+minStoreTime>current)
-      return;
+    for (map<string, Entry>::iterator i=entries.begin(); i!=entries.end(); ++i)
+      {
+	if (i->second.used)
+	  count++;
+	else
+	  dirty = true;
+      }
 
-    if (file_size((char*)currentFile.c_str())>maxFileSize)
-      createNewFile();
+    if (!dirty)
+      return true;
+
+    out+=(char)KC_CACHE_VERSION;
+    kcPutVarint(out, count);
+    for (map<string, Entry>::iterator i=entries.begin(); i!=entries.end(); ++i)
+      {
+	if (!i->second.used)
+	  continue;
+	kcPutVarint(out, i->first.size());
+	out+=i->first;
+	kcPutVarint(out, i->second.size);
+	kcPutVarint(out, i->second.mtime);
+	kcPutVarint(out, i->second.data.size());
+	out+=i->second.data;
+      }
+    crc = kcCrc32(out.data(), out.size());
+    for (int i=0; i<4; ++i)
+      out+=(char)((crc>>(8*i))&0xFF);
 
-    of.open(currentFile.c_str(), ios::app);
+    ofstream of(temp.c_str(), ios::trunc | ios::binary);
     if (!of.is_open())
-      criticalError("Can't open log file");
-    of << "9 Save: "<<current<<endl;
-    of << intervalLog;
-    of << keyDebug();
+      return false;
+    of << out;
     of.close();
-    lastStore=current;
-    intervalLog="";
-    keyTimes.clear();
+    if ( (of.fail()) || (rename(temp.c_str(), path.c_str())<0) )
+      return false;
+
+    dirty = false;
+    return true;
   }
 
-  void createNewFile()
+private:
+  struct Entry
   {
-    stringstream ss;
-    ofstream of;
-
-    ss<<time(NULL)<<".log";
-    currentFile = logPath+"/"+ss.str();
+    long long size;
+    long long mtime;
+    string data;
+    bool used;
+  };
 
-    of.open(currentFile.c_str(), ios::trunc);
-    if (!of.is_open())
-      criticalError("Failed to create file "+currentFile);
+  string path;
+  map<string, Entry> entries;
+  bool dirty;
 
-    of.close();
+  static uint32_t readCrc(string_view data)
+  {
+    uint32_t crc = 0;
+    for (int i=0; i<4; ++i)
+      crc|=(uint32_t)(unsigned char)data[i]<<(8*i);
+    return crc;
   }
-
 };
 
-GEventRecorder* GEventRecorder::instance=NULL;
-
-void eventCallback(XPointer priv, XRecordInterceptData *d)
+/* Parses one log file into a KCFileStats. Doesn't touch any shared
+   state, so many of them can run at once */
+class KCLogParser
 {
-  Priv *p=(Priv *) priv;
-  unsigned int type, detail;
-  unsigned char *ud1, type1, detail1;
-  GEventRecorder *er = GEventRecorder::getInstance();
-
-  if (d->category!=XRecordFromServer || p->doit==0)
-    {
-      cerr << "Skipping..." << endl;
-    }
-  else
-    {
-      ud1=(unsigned char *)d->data;
+public:
+  KCLogParser(KCFileStats &stats, const KCTimeRange &range=KCTimeRange(), const string &indexDir=""):
+    stats(stats), range(range), indexDir(indexDir), inRange(range.since==0), finished(false),
+    hour(NULL)
+  {
+  }
 
-      type1=ud1[0]&0x7F; type=type1;
-      detail1=ud1[1]; detail=detail1;
+  void parseFile()
+  {
+    const char *data;
+    long long size;
+    size_t offset = 0;
 
-      switch (type) 
-	{
-	case KeyPress:
-	  cout << "Press "<<detail<<" ("<<getKeysymStr(p, detail)<<")"<<endl;
-	  er->monitorKey(0, getKeysymStr(p, detail));
-	  if ( (EXIT_ON_ESCAPE) && (getKeysymStr(p, detail)=="Escape") )
-	    p->doit=false;
-	  break;
-      
-	case KeyRelease:
-	  // cout << "KeyRelease " << getKeysymStr(p,detail) << endl;
-	  break;
-	default: 
-	  cout <<"Nothing here"<<endl; // Press event sometimes
-	}
-    }
-  XRecordFreeData(d);
-}
+    size = file_map(&data, stats.name.c_str());
+    if (size<0)
+      return;
 
-Display * localDisplay () {
+    string_view buffer(data, size);
+    stats.ok = true;
+    if (isBinarySegment(buffer))
+      parseBinary(buffer);
+    else
+      {
+	// Jump to the first save in range
+	if (range.since>0)
+	  offset = KCSeekIndex::find(stats.name, buffer, indexDir, range.since);
+	parseBuffer(buffer.substr(offset));
+      }
+    file_unmap(data, size);
+  }
 
-  // open the display
-  Display * D = XOpenDisplay ( 0 );
+  /* Walks a whole log in memory, line by line, without copying it */
+  void parseBuffer(string_view buffer)
+  {
+    KCLineScanner scanner(buffer);
+    KCStatLine line;
 
-  if ( ! D ) {
-    criticalError((string)": could not open display \""+(string)XDisplayName ( 0 )+"\", aborting.");
+    while ( (!finished) && (scanner.next(line)) )
+      {
+	if ( (!this->parseStatLine(line)) && (!line.line.empty()))
+	  stats.errors.push_back("Wrong data line: \""+string(line.line)+"\"");
+      }
   }
 
-  // return the display
-  return D;
-}
+  /* Same for a binary segment, a block at a time */
+  void parseBinary(string_view buffer)
+  {
+    KCSegmentReader reader(buffer);
+    KCBlock block;
+    vector<unsigned*> slots;	/* Counter of every key id */
+    int res;
 
-void eventLoop (Display * LocalDpy, int LocalScreen,
-                                Display * RecDpy) {
+    while ( (!finished) && ((res=reader.next(block))>0) )
+      {
+	if (block.hasSave)
+	  saveState(block.save);
 
-  Window       Root, rRoot, rChild;
-  XRecordContext rc;
-  XRecordRange *rr;
-  XRecordClientSpec rcs;
-  Priv         priv;
-  int rootx, rooty, winx, winy;
-  unsigned int mmask;
-  Bool ret;
-  Status sret;
+	for (unsigned i=0; i<block.names.size(); ++i)
+	  if (block.names[i].first<slots.size())
+	    slots[block.names[i].first] = NULL;
 
-  // get the root window and set default target
-  Root = RootWindow ( LocalDpy, LocalScreen );
+	if (!inRange)
+	  continue;
 
-  ret=XQueryPointer(LocalDpy, Root, &rRoot, &rChild, &rootx, &rooty, &winx, &winy, &mmask);
-  cerr << "XQueryPointer returned: " << ret << endl;
-  rr=XRecordAllocRange();
-  if (!rr)
-  {
-        cerr << "Could not alloc record range, aborting." << endl;
-        exit(EXIT_FAILURE);
-  }
-  rr->device_events.first=KeyPress;
-  rr->device_events.last=KeyRelease;
-  rcs=XRecordAllClients;
-  rc=XRecordCreateContext(RecDpy, 0, &rcs, 1, &rr, 1);
-  if (!rc)
-  {
-        cerr << "Could not create a record context, aborting." << endl;
-        exit(EXIT_FAILURE);
-  }
-  priv.x=rootx;
-  priv.y=rooty;
-  priv.mmoved=1;
-  priv.Status2=0;
-  priv.Status1=2;
-  priv.doit=1;
-  priv.LocalDpy=LocalDpy;
-  priv.RecDpy=RecDpy;
-  priv.rc=rc;
+	stats.typing.insert(stats.typing.end(), block.typing.begin(), block.typing.end());
 
-  if (!XRecordEnableContextAsync(RecDpy, rc, eventCallback, (XPointer) &priv))
-  {
-        cerr << "Could not enable the record context, aborting." << endl;
-        exit(EXIT_FAILURE);
-  }
+	if (block.keys.empty())
+	  continue;
 
-  while ((priv.doit) && (!Exit_signal) ) 
+	unsigned &hour = stats.hourly[stats.current_time];
+	for (unsigned i=0; i<block.keys.size(); ++i)
+	  {
+	    unsigned id = block.keys[i].id;
+	    if (id>=slots.size())
+	      slots.resize(id+1, NULL);
+	    if (slots[id]==NULL)
+	      slots[id] = &stats.keyTimes[reader.keyName(id)];
+
+	    *slots[id]+=block.keys[i].presses;
+	    hour+=block.keys[i].presses;
+	  }
+      }
+
+    if ( (!finished) && (res<0) )
+      stats.errors.push_back("Corrupt binary block at offset "+to_string(reader.offset())+
+			     " (error "+to_string(res)+"), skipping the rest of the file");
+  }
+
+private:
+  KCFileStats &stats;
+  KCTimeRange range;
+  string indexDir;
+  bool inRange;			/* Current block is in the range */
+  bool finished;		/* Past the range, nothing else to read */
+  unsigned *hour;		/* Presses of current_time, NULL until needed */
+
+  /* Counters of the keys seen last, so most lines don't search keyTimes */
+  struct KeySlot
+  {
+    string_view name;		/* Points to the key in keyTimes */
+    unsigned *presses;
+
+    KeySlot(): presses(NULL)
+    {
+    }
+  };
+  KeySlot keySlots[256];
+
+  void keyPress(string_view keysym, int times)
+  {
+    if (hour==NULL)
+      hour = &stats.hourly[stats.current_time];
+    *hour+=times;
+
+    KeySlot &slot = keySlots[(keysym.size()*31+((keysym.empty())?0:keysym[0]*7+keysym.back()))&0xFF];
+    if ( (slot.presses==NULL) || (slot.name!=keysym) )
+      {
+	// Only allocate the key name the first time we see it
+	map<string, unsigned, less<> >::iterator k = stats.keyTimes.find(keysym);
+	if (k==stats.keyTimes.end())
+	  k = stats.keyTimes.emplace(string(keysym), 0).first;
+	slot.name = k->first;
+	slot.presses = &k->second;
+      }
+    *slot.presses+=times;
+  }
+
+  void saveState(size_t time)
+  {
+    inRange = range.contains(time);
+    if ((time_t)time>range.until)
+      {
+	finished = true;
+	return;
+      }
+    if (!inRange)
+      return;
+
+    if (stats.current_time!=(time_t)(3600* (time/3600)))
+      hour = NULL;
+    stats.current_time = 3600* (time/3600);
+    stats.last_saved=time;
+  }
+
+  bool parseStatLine(const KCStatLine &line)
+  {
+    if ( (!inRange) && (line.command!=9) )
+      return (line.command!=0);
+
+    switch (line.command)
+      {
+      case 1:
+	keyPress(line.keysym, line.value);
+	return true;
+      case 7:
+      case 8:
+	stats.typing.push_back(make_pair(line.command, (time_t)(size_t)line.value));
+	return true;
+      case 9:
+	saveState(line.value);
+	return true;
+      default:
+	return false;
+      }
+  }
+};
+
+static void writeInterval(KCReport &report, const string &user, const char *name, const KCInterval &times)
+{
+  if (!times.valid)
+    return;
+
+  if (!user.empty())
+    report.field(user);
+  report.field(name);
+  report.field(times.histogram.count());
+  report.field(times.quantile(0.5));
+  report.field(times.quantile(0.9));
+  report.field(times.quantile(0.99));
+  report.field(times.longest);
+  report.field(times.longestSince);
+  report.field(times.shortest);
+  report.field(times.shortestSince);
+  report.endRow();
+}
+
+static void writeHistogram(KCReport &report, const string &user, const char *name, const KCHistogram &histogram)
+{
+  for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+    {
+      if (!histogram.at(i))
+	continue;
+      if (!user.empty())
+	report.field(user);
+      report.field(name);
+      report.field(KCHistogram::lowerBound(i));
+      report.field(KCHistogram::upperBound(i));
+      report.field(histogram.at(i));
+      report.endRow();
+    }
+}
+
+/* Columns of writeSummary() rows */
+vector<string> summaryColumns(const string &mode, bool user)
+{
+  vector<string> columns;
+
+  if (user)
+    columns.push_back("user");
+  if (mode=="keycount")
+    columns.insert(columns.end(), {"key", "presses"});
+  else if (mode=="hourly")
+    columns.insert(columns.end(), {"timestamp", "date", "presses"});
+  else if (mode=="histogram")
+    columns.insert(columns.end(), {"interval", "from", "to", "count"});
+  else
+    columns.insert(columns.end(), {"interval", "count", "p50", "p90", "p99",
+	  "longest", "longest_since", "shortest", "shortest_since"});
+  return columns;
+}
+
+/* Report rows of a summary, user (if not empty) is the first column.
+   Presses before the first save of the data set go to hour 0, as the
+   analyzer does */
+void writeSummary(const string &mode, KCReport &report, const string &user, const KCSummary &summary)
+{
+  if (mode=="keycount")
+    {
+      for (map<string, unsigned, less<> >::const_iterator i=summary.keyTimes.begin(); i!=summary.keyTimes.end(); ++i)
+	{
+	  if (!user.empty())
+	    report.field(user);
+	  report.field(i->first);
+	  report.field(i->second);
+	  report.endRow();
+	}
+    }
+  else if (mode=="hourly")
+    {
+      map<time_t, unsigned> hours = summary.hourly;
+      if (summary.leadPresses)
+	hours[0]+=summary.leadPresses;
+      for (map<time_t, unsigned>::const_iterator i=hours.begin(); i!=hours.end(); ++i)
+	{
+	  if (!user.empty())
+	    report.field(user);
+	  report.field(i->first);
+	  report.field(strtime(i->first, "%d/%m/%Y %H:%M"));
+	  report.field(i->second);
+	  report.endRow();
+	}
+    }
+  else if (mode=="histogram")
+    {
+      writeHistogram(report, user, "Writing", summary.writing.histogram);
+      writeHistogram(report, user, "Idle", summary.idle.histogram);
+    }
+  else
+    {
+      writeInterval(report, user, "Writing", summary.writing);
+      writeInterval(report, user, "Idle", summary.idle);
+    }
+}
+
+#define BURST_SUMMARY 0
+#define BURST_INTERVALS 1
+#define BURST_HISTOGRAM 2
+
+/* Log segments are named after their creation time, sort them that way
+   so the burst state machine sees events in the order they happened */
+bool segmentOrder(const string &a, const string &b)
+{
+  long long ta = atoll(a.c_str()+a.rfind('/')+1);
+  long long tb = atoll(b.c_str()+b.rfind('/')+1);
+
+  if (ta!=tb)
+    return ta<tb;
+  return a<b;
+}
+
+#define KC_COMPACT_JOURNAL ".compact"
+
+/* Writes a whole file and waits for it to reach the disk */
+bool writeFileSync(const string &path, string_view data)
+{
+  ssize_t res;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (fd<0)
+    return false;
+  while (!data.empty())
+    {
+      res = write(fd, data.data(), data.size());
+      if ( (res<0) && (errno==EINTR) )
+	continue;
+      if (res<=0)
+	{
+	  close(fd);
+	  return false;
+	}
+      data.remove_prefix(res);
+    }
+  res = fsync(fd);
+  return ( (close(fd)==0) && (res==0) );
+}
+
+/* Makes renames and unlinks in a directory durable */
+void syncDir(const string &dir)
+{
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd<0)
+    return;
+  fsync(fd);
+  close(fd);
+}
+
+/* Compaction journal: temporary rollup, final rollup and the segments
+   it replaces, one per line. While the temporary rollup exists nothing
+   has been replaced yet. When it doesn't, the rollup is in place and
+   the segments listed are leftovers: they must be skipped and, if
+   finish is true, deleted (with the journal). Returns the leftovers */
+vector<string> compactLeftovers(const string &dir, bool finish)
+{
+  vector<string> lines, leftovers;
+  string line, journal = dir+"/"+KC_COMPACT_JOURNAL;
+  ifstream in(journal.c_str());
+
+  if (!in.is_open())
+    return leftovers;
+  while (getline(in, line))
+    lines.push_back(line);
+  in.close();
+
+  if ( (lines.size()>=2) && (access((dir+"/"+lines[0]).c_str(), F_OK)<0) )
+    leftovers.assign(lines.begin()+2, lines.end());
+
+  if (finish)
+    {
+      if (lines.size()>=1)
+	unlink((dir+"/"+lines[0]).c_str());
+      for (unsigned i=0; i<leftovers.size(); ++i)
+	unlink((dir+"/"+leftovers[i]).c_str());
+      syncDir(dir);
+      unlink(journal.c_str());
+    }
+  return leftovers;
+}
+
+/* Segments of a data directory in segment order. Hidden files (the
+   compaction journal and temporary files) and leftovers of an
+   interrupted compaction are not segments */
+vector<string> segmentList(const string &dir)
+{
+  vector<string> files;
+  vector<string> leftovers = compactLeftovers(dir, false);
+  DIR *d;
+  struct dirent *ent;
+
+  d = opendir(dir.c_str());
+  if (d == NULL)
+    criticalError("Can't open log directory");
+
+  while ((ent = readdir (d)) != NULL)
+    {
+      if ( (ent->d_name[0]!='.') && (find(leftovers.begin(), leftovers.end(), ent->d_name)==leftovers.end()) )
+	files.push_back(dir+(string)"/"+ent->d_name);
+    }
+  closedir (d);
+  sort(files.begin(), files.end(), segmentOrder);
+  return files;
+}
+
+/* A report built from the records of the files, as KCAnalyzer merges
+   them in time order. Any number of them are fed by the same pass over
+   the data, so another report doesn't read the logs again */
+class KCRecordConsumer
+{
+public:
+  virtual ~KCRecordConsumer()
+  {
+  }
+
+  /* Presses of every key in a file */
+  virtual void keys(const map<string, unsigned, less<> > &)
+  {
+  }
+
+  /* Presses in an hour */
+  virtual void hour(time_t, unsigned)
+  {
+  }
+
+  /* Presses before the first save, reported at an hour as nothing
+     better is known */
+  virtual void lead(time_t, unsigned)
+  {
+  }
+
+  /* A typing burst (typing) or the pause after it, once it's over */
+  virtual void interval(bool, time_t, unsigned)
+  {
+  }
+
+  /* After the last record: writes the report */
+  virtual void finish()
+  {
+  }
+};
+
+/* Presses of every key */
+class KCKeyReport : public KCRecordConsumer
+{
+public:
+  KCKeyReport(KCReport &report): report(report)
+  {
+  }
+
+  void keys(const map<string, unsigned, less<> > &keyTimes)
+  {
+    for (map<string, unsigned, less<> >::const_iterator i=keyTimes.begin(); i!=keyTimes.end(); ++i)
+      totals[i->first]+=i->second;
+  }
+
+  void finish()
+  {
+    report.begin({"key", "presses"});
+    for (map<string, unsigned, less<> >::iterator i=totals.begin(); i!=totals.end(); ++i)
+      {
+	report.field(i->first);
+	report.field(i->second);
+	report.endRow();
+      }
+    report.end();
+  }
+
+private:
+  KCReport &report;
+  map<string, unsigned, less<> > totals;
+};
+
+#define TIME_HOURLY 0
+#define TIME_DAILY 1
+#define TIME_WEEKLY 2
+#define TIME_HEATMAP 3
+
+/* Presses by hour, local day, week (from Monday), or by day of the week
+   and hour of the day, a row per day (TIME_HEATMAP) */
+class KCTimeReport : public KCRecordConsumer
+{
+public:
+  KCTimeReport(KCReport &report, int output): report(report), output(output)
+  {
+  }
+
+  void hour(time_t hour, unsigned presses)
+  {
+    timeline.add(hour, presses);
+  }
+
+  void lead(time_t hour, unsigned presses)
+  {
+    timeline.lead(hour, presses);
+  }
+
+  void finish()
+  {
+    if (output==TIME_HOURLY)
+      {
+	map<time_t, unsigned> hours = timeline.hours();
+	report.begin({"timestamp", "date", "presses"});
+	for (map<time_t, unsigned>::iterator i=hours.begin(); i!=hours.end(); ++i)
+	  {
+	    report.field(i->first);
+	    report.field(strtime(i->first, "%d/%m/%Y %H:%M"));
+	    report.field(i->second);
+	    report.endRow();
+	  }
+	report.end();
+      }
+    else if (output==TIME_HEATMAP)
+      heatmap();
+    else
+      {
+	vector<pair<time_t, uint64_t> > periods = (output==TIME_WEEKLY)?timeline.weeks():timeline.days();
+	report.begin({"timestamp", "date", "presses"});
+	for (unsigned i=0; i<periods.size(); ++i)
+	  {
+	    report.field(periods[i].first);
+	    report.field(strtime(periods[i].first, "%d/%m/%Y"));
+	    report.field((unsigned long)periods[i].second);
+	    report.endRow();
+	  }
+	report.end();
+      }
+  }
+
+private:
+  KCReport &report;
+  int output;
+  KCTimeline timeline;
+
+  void heatmap()
+  {
+    const char *days[] = { "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+			   "Saturday", "Sunday" };
+    vector<string> columns(1, "day");
+    uint64_t cells[7][24];
+
+    timeline.heatmap(cells);
+    for (unsigned h=0; h<24; ++h)
+      columns.push_back(((h<10)?"h0":"h")+to_string(h));
+    report.begin(columns);
+    for (unsigned d=0; d<7; ++d)
+      {
+	report.field(days[d]);
+	for (unsigned h=0; h<24; ++h)
+	  report.field((unsigned long)cells[d][h]);
+	report.endRow();
+      }
+    report.end();
+  }
+};
+
+/* Typing and idle times: quantiles (BURST_SUMMARY) or their histogram */
+class KCBurstReport : public KCRecordConsumer
+{
+public:
+  KCBurstReport(KCReport &report, int output): report(report), output(output)
+  {
+  }
+
+  void interval(bool typing, time_t since, unsigned seconds)
+  {
+    if (typing)
+      totals.writing.add(seconds, since);
+    else
+      totals.idle.add(seconds, since);
+  }
+
+  void finish()
+  {
+    string mode = (output==BURST_HISTOGRAM)?"histogram":"burst";
+
+    report.begin(summaryColumns(mode, false));
+    writeSummary(mode, report, "", totals);
+    report.end();
+  }
+
+private:
+  KCReport &report;
+  int output;
+  KCSummary totals;
+};
+
+/* Every typing burst and pause, as rows of a report, written as they
+   come */
+class KCIntervalLog : public KCRecordConsumer
+{
+public:
+  KCIntervalLog(KCReport &report): report(report)
+  {
+    report.begin({"state", "since", "seconds"});
+  }
+
+  void interval(bool typing, time_t since, unsigned seconds)
+  {
+    report.field((typing)?"Start":"Stop");
+    report.field((int)since);
+    report.field((int)seconds);
+    report.endRow();
+  }
+
+  void finish()
+  {
+    report.end();
+  }
+
+private:
+  KCReport &report;
+};
+
+class KCAnalyzer
+{
+public:
+  KCAnalyzer(): useCache(true), verbose(true), threads(0)
+  {
+  }
+  ~KCAnalyzer()
+  {
+  }
+
+  /* Analyze another directory instead of ~/.keyCounter */
+  void setDataDir(const string &dir)
+  {
+    dataDir = dir;
+  }
+
+  void setCache(bool use)
+  {
+    useCache = use;
+  }
+
+  /* Tell which files are being read */
+  void setVerbose(bool verbose)
+  {
+    this->verbose = verbose;
+  }
+
+  /* Only analyze saves between since and until */
+  void setRange(const KCTimeRange &range)
+  {
+    this->range = range;
+  }
+
+  /* Threads parsing files, 0 for one per core */
+  void setThreads(unsigned threads)
+  {
+    this->threads = threads;
+  }
+
+  /* Reads everything, for callers using the totals directly */
+  void analyze()
+  {
+    this->getStats();
+  }
+
+  /* Reads everything once, feeding all those reports. They are
+     finished by the caller */
+  void feed(const vector<KCRecordConsumer*> &reports)
+  {
+    consumers = reports;
+    this->getStats();
+    consumers.clear();
+  }
+
+  /* A report by itself */
+  void run(KCRecordConsumer &report)
+  {
+    this->feed(vector<KCRecordConsumer*>(1, &report));
+    report.finish();
+  }
+
+  const map<string, unsigned, less<> > &keyCounts() const
+  {
+    return keyTimes;
+  }
+
+  const KCTimeline &hourCounts() const
+  {
+    return hourly;
+  }
+
+  const KCInterval &writingTimes() const
+  {
+    return writing;
+  }
+
+  const KCInterval &idleTimes() const
+  {
+    return idle;
+  }
+
+  /* Totals of the last analysis, with what's needed to join them with
+     the analysis of the data before or after */
+  void summary(KCSummary &out) const
+  {
+    out = KCSummary();
+    out.keyTimes = keyTimes;
+    out.hourly = hourly.hours();
+    out.writing = writing;
+    out.idle = idle;
+
+    // Presses before the first save went to the first hour, as we
+    // didn't know better
+    out.leadPresses = leadPresses;
+    if (leadPresses)
+      {
+	map<time_t, unsigned>::iterator h = out.hourly.find(firstHour);
+	if ( (h!=out.hourly.end()) && ((h->second-=leadPresses)==0) )
+	  out.hourly.erase(h);
+      }
+    out.hasHour = hasHour;
+    out.lastHour = current_time;
+
+    if (headStop)
+      {
+	out.head|=KC_HEAD_STOP;
+	out.headStop = headStop;
+      }
+    if (headStart)
+      {
+	out.head|=KC_HEAD_START;
+	out.headStart = headStart;
+      }
+    if (state&8)
+      {
+	out.tail = 8;
+	out.tailSince = last_started;
+      }
+    else if (state&4)
+      {
+	out.tail = 7;
+	out.tailSince = last_stopped;
+      }
+  }
+
+  void keycount(KCReport &report)
+  {
+    KCKeyReport keys(report);
+
+    this->run(keys);
+  }
+
+  /* Typing and idle times: quantiles (BURST_SUMMARY), their histogram
+     or every interval, written while files are read */
+  void burst(KCReport &report, int output=BURST_SUMMARY)
+  {
+    if (output==BURST_INTERVALS)
+      {
+	KCIntervalLog log(report);
+	this->run(log);
+      }
+    else
+      {
+	KCBurstReport bursts(report, output);
+	this->run(bursts);
+      }
+    burstExtremes();
+  }
+
+  /* Longest and shortest bursts and pauses of the last analysis */
+  void burstExtremes() const
+  {
+    cerr << "Max writing time: "<<writing.longest<<"s since "<<strtime(writing.longestSince, "%d/%m/%Y %H:%M")<<endl;
+    cerr << "Max idle time: "<<idle.longest<< "s since "<<strtime(idle.longestSince, "%d/%m/%Y %H:%M")<<endl;
+    cerr << "Min writing time: "<<writing.shortest<<"s since "<<strtime(writing.shortestSince, "%d/%m/%Y %H:%M")<<endl;
+    cerr << "Min idle time: "<<idle.shortest<< "s since "<<strtime(idle.shortestSince, "%d/%m/%Y %H:%M")<<endl;
+  }
+
+  void hourlyLog(KCReport &report)
+  {
+    KCTimeReport hours(report, TIME_HOURLY);
+
+    this->run(hours);
+  }
+
+  /* Presses of every local day (or week, from Monday) with any */
+  void periodLog(KCReport &report, bool weekly)
+  {
+    KCTimeReport periods(report, (weekly)?TIME_WEEKLY:TIME_DAILY);
+
+    this->run(periods);
+  }
+
+  /* Presses by day of the week and hour of the day, a row per day */
+  void heatmap(KCReport &report)
+  {
+    KCTimeReport cells(report, TIME_HEATMAP);
+
+    this->run(cells);
+  }
+
+private:
+  vector <string> fileList;
+  string dataDir;
+  bool useCache;
+  bool verbose;
+  unsigned threads;
+  KCTimeRange range;
+  map<string, unsigned, less<> > keyTimes;
+  KCTimeline hourly;
+  int state;
+  time_t last_started, last_stopped;
+  KCInterval writing;		/* Typing bursts */
+  KCInterval idle;		/* Pauses between them */
+  time_t headStop;		/* Stop before anything started */
+  time_t headStart;		/* First start, idle time before it unknown */
+  unsigned leadPresses;		/* Presses before the first save */
+  bool hasHour;			/* A save has been seen */
+  time_t firstHour;
+  vector<KCRecordConsumer*> consumers; /* Reports being built */
+  time_t current_time;
+
+  void parseStartTyping(size_t time)
+  {
+    size_t diff;
+
+    if (!(state&8))
+      {
+	if ( (!(state&4)) && (!headStart) )
+	  headStart = time;
+	if (state&4)		// It has been stopped at least once
+	  {
+	    diff = time-last_stopped;
+	    for (unsigned i=0; i<consumers.size(); ++i)
+	      consumers[i]->interval(false, last_stopped, diff);
+	    idle.add(diff, last_stopped);
+	  }
+
+	last_started=time;
+	state+=8;
+      }
+    else
+      {
+	cerr << "Caution, we have just started typing... possible bug"<<endl;
+      }
+  }
+
+  void parseStopTyping(size_t time)
+  {
+    size_t diff;
+
+    if (state&8)		// Typing started
+      {
+	if (!(state&4))		// First time stopped
+	  state+=4;
+	
+	diff=time-last_started;
+	for (unsigned i=0; i<consumers.size(); ++i)
+	  consumers[i]->interval(true, last_started, diff);
+	writing.add(diff, last_started);
+
+	last_stopped=time;
+	state-=8;
+      }
+    else
+      {
+	if ( (!(state&4)) && (!headStart) && (!headStop) )
+	  headStop = time;
+	cerr << "Caution! Typing is already stopped... possible bug"<<endl;
+      }
+  }
+
+  /* Adds a parsed file to the totals. Files must be merged in
+     segment order */
+  void mergeFile(KCFileStats &file)
+  {
+    for (map<string, unsigned, less<> >::iterator i=file.keyTimes.begin(); i!=file.keyTimes.end(); ++i)
+      keyTimes[i->first]+=i->second;
+    for (unsigned i=0; i<consumers.size(); ++i)
+      consumers[i]->keys(file.keyTimes);
+
+    for (map<time_t, unsigned>::iterator i=file.hourly.begin(); i!=file.hourly.end(); ++i)
+      {
+	time_t hour = (i->first==KC_INHERIT_HOUR)?current_time:i->first;
+	if ( (i->first==KC_INHERIT_HOUR) && (!hasHour) )
+	  {
+	    // Out of the timeline, its start is the first save
+	    leadPresses+=i->second;
+	    hourly.lead(hour, i->second);
+	    for (unsigned c=0; c<consumers.size(); ++c)
+	      consumers[c]->lead(hour, i->second);
+	    continue;
+	  }
+	hourly.add(hour, i->second);
+	for (unsigned c=0; c<consumers.size(); ++c)
+	  consumers[c]->hour(hour, i->second);
+      }
+
+    for (unsigned i=0; i<file.typing.size(); ++i)
+      {
+	if (file.typing[i].first==8)
+	  parseStartTyping(file.typing[i].second);
+	else
+	  parseStopTyping(file.typing[i].second);
+      }
+
+    if (file.current_time!=KC_INHERIT_HOUR)
+      {
+	current_time = file.current_time;
+	hasHour = true;
+      }
+  }
+
+  /* Parses the files whose positions are in todo on a pool of threads */
+  void parseFiles(vector<KCFileStats> &files, const vector<size_t> &todo)
+  {
+    atomic<size_t> next(0);
+    vector<thread> pool;
+    unsigned nthreads = (threads)?threads:thread::hardware_concurrency();
+
+    if (nthreads==0)
+      nthreads = 1;
+    if (nthreads>todo.size())
+      nthreads = todo.size();
+
+    for (unsigned t=0; t<nthreads; ++t)
+      pool.push_back(thread([&]()
+	{
+	  size_t i;
+	  while ( (i=next++)<todo.size() )
+	    {
+	      KCFileStats &file = files[todo[i]];
+	      if (file.partial)
+		KCLogParser(file, range, dataDir+".index").parseFile();
+	      else
+		KCLogParser(file).parseFile();
+	    }
+	}));
+
+    for (unsigned t=0; t<pool.size(); ++t)
+      pool[t].join();
+  }
+
+  void getStats()
+  {
+    vector<long long> sizes, mtimes;
+    vector<size_t> todo;
+    struct stat sinfo;
+
+    this->state=0;
+    this->keyTimes.clear();
+    this->hourly = KCTimeline();
+    this->writing = KCInterval();
+    this->idle = KCInterval();
+    this->headStop = this->headStart = 0;
+    this->leadPresses = 0;
+    this->hasHour = false;
+    this->current_time=3600*(range.since/3600);
+    this->firstHour = this->current_time;
+    generateFileList();
+
+    KCSummaryCache cache(dataDir+".cache");
+    if (useCache)
+      cache.load();
+
+    vector<KCFileStats> files;
+    for (unsigned i = 0; i<fileList.size(); ++i)
+      {
+	KCFileStats file;
+	file.name = fileList[i];
+	long long size = -1, mtime = -1;
+	if (stat(fileList[i].c_str(), &sinfo)==0)
+	  {
+	    size = sinfo.st_size;
+	    mtime = sinfo.st_mtim.tv_sec*1000000000LL+sinfo.st_mtim.tv_nsec;
+	  }
+
+	// A segment goes from its creation to the next one
+	if (!range.all())
+	  {
+	    time_t start = atoll(fileList[i].c_str()+fileList[i].rfind('/')+1);
+	    time_t end = (i+1<fileList.size())?
+	      atoll(fileList[i+1].c_str()+fileList[i+1].rfind('/')+1):
+	      ((mtime>=0)?mtime/1000000000LL:start);
+	    if ( (start>0) && (end>=start) )
+	      {
+		if ( (start>range.until) || (end<range.since) )
+		  {
+		    cache.keep(file.name);
+		    continue;
+		  }
+		file.partial = !( (range.contains(start)) && (range.contains(end)) );
+	      }
+	    else
+	      file.partial = true;
+	  }
+
+	files.push_back(file);
+	sizes.push_back(size);
+	mtimes.push_back(mtime);
+	// Partial results depend on the range, they are never cached
+	if (file.partial)
+	  cache.keep(file.name);
+	else if ( (size>=0) && (useCache) && (cache.find(files.back(), size, mtime)) )
+	  continue;
+	todo.push_back(files.size()-1);
+      }
+
+    parseFiles(files, todo);
+
+    for (unsigned i = 0; (useCache) && (i<todo.size()); ++i)
+      {
+	if ( (files[todo[i]].ok) && (!files[todo[i]].partial) && (sizes[todo[i]]>=0) )
+	  cache.store(files[todo[i]], sizes[todo[i]], mtimes[todo[i]]);
+      }
+    if ( (useCache) && (!cache.save()) )
+      cerr << "Can't write summary cache "<<dataDir<<".cache"<<endl;
+
+    for (unsigned i = 0; i<files.size(); ++i)
+      {
+	if (verbose)
+	  cerr << "Reading "<<files[i].name<<endl;
+	if (!files[i].ok)
+	  {
+	    cerr << "Skipping "+files[i].name<<endl;
+	    continue;
+	  }
+	if (verbose)
+	  cerr << "read lines..."<<endl;
+	for (unsigned j=0; j<files[i].errors.size(); ++j)
+	  cerr << files[i].errors[j]<<endl;
+	mergeFile(files[i]);
+	files[i] = KCFileStats();
+      }
+  }
+
+  void generateFileList()
+  {
+    if (fileList.size()!=0)
+      return;
+
+    string origin = dataDir;
+    if (origin.empty())
+      origin = dataDirectory("");
+
+    if (directory_exists(origin.c_str())<1)
+      criticalError("No data to analyze");
+    dataDir = origin;
+
+    fileList = segmentList(origin);
+  }
+};
+
+/* Analyzes many data directories (one per user) at once, each one with
+   its own analyzer on a pool of threads. Results are reported for every
+   directory, in the order given, and then for all of them together.
+   Workers never get more than a few directories ahead of the report,
+   so memory doesn't grow with the number of directories */
+class KCFleet
+{
+public:
+  KCFleet(const vector<string> &roots, const KCTimeRange &range, unsigned jobs):
+    roots(roots), range(range), jobs(jobs), next(0), reported(0)
+  {
+    unsigned cores = thread::hardware_concurrency();
+
+    if (cores==0)
+      cores = 1;
+    if (this->jobs==0)
+      this->jobs = cores;
+    if (this->jobs>roots.size())
+      this->jobs = roots.size();
+    // Cores not used by jobs help parsing each directory
+    perJob = (this->jobs)?cores/this->jobs:1;
+    if (perJob==0)
+      perJob = 1;
+  }
+
+  /* mode is keycount, hourly, burst or histogram */
+  void run(const string &mode, KCReport &report)
+  {
+    vector<thread> pool;
+
+    report.begin(summaryColumns(mode, true));
+
+    done.resize(roots.size());
+    for (unsigned t=0; t<jobs; ++t)
+      pool.push_back(thread(&KCFleet::worker, this));
+
+    for (size_t i=0; i<roots.size(); ++i)
+      {
+	unique_ptr<KCAnalyzer> analyzer;
+	{
+	  unique_lock<mutex> lock(mtx);
+	  ready.wait(lock, [&]() { return done[i]!=nullptr; });
+	  analyzer.swap(done[i]);
+	  reported = i+1;
+	}
+	room.notify_all();
+
+	KCSummary summary;
+	analyzer->summary(summary);
+	analyzer.reset();
+	writeSummary(mode, report, roots[i], summary);
+	total.add(summary);
+      }
+
+    for (unsigned t=0; t<pool.size(); ++t)
+      pool[t].join();
+
+    writeSummary(mode, report, "all", total);
+    report.end();
+  }
+
+private:
+  vector<string> roots;
+  KCTimeRange range;
+  unsigned jobs;
+  unsigned perJob;		/* Parsing threads of every analyzer */
+  mutex mtx;
+  condition_variable ready;	/* An analyzer finished */
+  condition_variable room;	/* A result was reported */
+  size_t next;			/* Next directory to analyze */
+  size_t reported;		/* Directories already reported */
+  vector<unique_ptr<KCAnalyzer> > done;
+  KCSummary total;
+
+  void worker()
+  {
+    size_t i;
+
+    for (;;)
+      {
+	{
+	  unique_lock<mutex> lock(mtx);
+	  room.wait(lock, [&]() { return (next>=roots.size()) || (next<reported+2*jobs); });
+	  if (next>=roots.size())
+	    return;
+	  i = next++;
+	}
+
+	unique_ptr<KCAnalyzer> analyzer(new KCAnalyzer());
+	analyzer->setDataDir(roots[i]);
+	analyzer->setVerbose(false);
+	analyzer->setThreads(perJob);
+	analyzer->setRange(range);
+	analyzer->analyze();
+
+	{
+	  lock_guard<mutex> lock(mtx);
+	  done[i].swap(analyzer);
+	}
+	ready.notify_all();
+      }
+  }
+
+};
+
+/* Rewrites old segments into binary rollups with a single block per
+   hour: presses are added by key and typing marks kept in order, which
+   is all the analysis needs. Each rollup replaces a run of consecutive
+   segments and is named after the first one (.kcr), so segment order
+   and range pruning still work. A crash at any moment leaves either the
+   old segments or the rollup, never both (see compactLeftovers()) */
+class KCCompactor
+{
+public:
+  KCCompactor(const string &dir): dir(dir), sources(0), written(0), saved(0)
+  {
+  }
+
+  /**
+   * @param before      only segments ending before this time are
+   *                    rewritten
+   * @param rollupBytes a new rollup is started once one gets this big
+   *
+   * @return rollups written, -1 on error
+   */
+  long run(time_t before, long long rollupBytes)
+  {
+    vector<string> files;
+    vector<bool> eligible;
+    long rollups = 0;
+
+    compactLeftovers(dir, true);
+    files = segmentList(dir);
+    if (files.size()<2)
+      return 0;
+
+    // The last segment may be still in use, and segment i ends where
+    // segment i+1 starts
+    eligible.resize(files.size(), false);
+    for (size_t i=0; i+1<files.size(); ++i)
+      eligible[i] = ( (!isRollup(files[i])) &&
+		      (atoll(baseName(files[i+1]).c_str())<=before) &&
+		      (access(rollupName(files[i]).c_str(), F_OK)<0) );
+
+    for (size_t i=0; i<files.size(); )
+      {
+	if (!eligible[i])
+	  {
+	    ++i;
+	    continue;
+	  }
+
+	// A rollup with consecutive segments, until it's big enough
+	vector<string> group;
+	string name = rollupName(files[i]);
+	KCSegmentWriter writer;
+	string out = writer.header(atoll(baseName(files[i]).c_str()));
+
+	block.clear();
+	pending = false;
+	keys.clear();
+	while ( (i<files.size()) && (eligible[i]) && ((long long)out.size()<rollupBytes) )
+	  {
+	    KCSegmentWriter oldWriter = writer;
+	    KCBlock oldBlock = block;
+	    map<string, unsigned> oldKeys = keys;
+	    bool oldPending = pending;
+	    size_t oldSize = out.size();
+
+	    if (!readSegment(files[i], writer, out))
+	      {
+		// Not clean (or unreadable): it stays as it is, and it
+		// ends the rollup
+		writer = oldWriter;
+		block = oldBlock;
+		keys.swap(oldKeys);
+		pending = oldPending;
+		out.resize(oldSize);
+		eligible[i] = false;
+		break;
+	      }
+	    group.push_back(files[i]);
+	    ++i;
+	  }
+	if (group.empty())
+	  continue;
+	flushBlock(writer, out);
+	if (!commit(name, out, group))
+	  return -1;
+	++rollups;
+      }
+    return rollups;
+  }
+
+  /* Segments replaced */
+  unsigned long sourceFiles() const
+  {
+    return sources;
+  }
+
+  /* Bytes of the rollups and bytes they replaced */
+  unsigned long long bytesWritten() const
+  {
+    return written;
+  }
+
+  unsigned long long bytesReplaced() const
+  {
+    return saved;
+  }
+
+private:
+  string dir;
+  unsigned long sources;
+  unsigned long long written;
+  unsigned long long saved;
+  KCBlock block;		/* Hour being built */
+  bool pending;			/* block has something */
+  map<string, unsigned> keys;	/* Presses of the block by name */
+
+  static string baseName(const string &path)
+  {
+    return path.substr(path.rfind('/')+1);
+  }
+
+  static bool isRollup(const string &path)
+  {
+    return ( (path.size()>4) && (path.compare(path.size()-4, 4, ".kcr")==0) );
+  }
+
+  string rollupName(const string &path)
+  {
+    string name = baseName(path);
+
+    return dir+"/"+name.substr(0, name.find('.'))+".kcr";
+  }
+
+  void flushBlock(KCSegmentWriter &writer, string &out)
+  {
+    if (!pending)
+      return;
+
+    for (map<string, unsigned>::iterator k=keys.begin(); k!=keys.end(); ++k)
+      {
+	KCKeyCount key;
+	key.id = writer.keyId(k->first);
+	key.presses = k->second;
+	block.keys.push_back(key);
+      }
+    out+=writer.block(block);
+    block.clear();
+    keys.clear();
+    pending = false;
+  }
+
+  /* A save in another hour starts a new block, saves in the same hour
+     are folded into the current one. Presses before the first save of a
+     segment belong to the last hour of the previous one, so they go to
+     the current block too */
+  void save(time_t when, KCSegmentWriter &writer, string &out)
+  {
+    if ( (pending) && ( (!block.hasSave) || (block.save/3600!=when/3600) ) )
+      flushBlock(writer, out);
+    block.hasSave = true;
+    block.save = when;
+    pending = true;
+  }
+
+  /* Adds a whole segment to the rollup. Returns false if it's not clean */
+  bool readSegment(const string &path, KCSegmentWriter &writer, string &out)
+  {
+    const char *data;
+    long long size;
+    bool clean = true;
+
+    size = file_map(&data, path.c_str());
+    if (size<0)
+      return false;
+
+    string_view buffer(data, size);
+    if (isBinarySegment(buffer))
+      {
+	KCSegmentReader reader(buffer);
+	KCBlock in;
+	int res;
+
+	while ( (res=reader.next(in))>0 )
+	  {
+	    if (in.hasSave)
+	      save(in.save, writer, out);
+	    block.typing.insert(block.typing.end(), in.typing.begin(), in.typing.end());
+	    for (unsigned k=0; k<in.keys.size(); ++k)
+	      keys[reader.keyName(in.keys[k].id)]+=in.keys[k].presses;
+	    pending = pending || (!in.typing.empty()) || (!in.keys.empty());
+	  }
+	clean = (res==0);
+      }
+    else
+      {
+	size_t pos = 0, eol;
+	string_view keysym;
+	int command, value;
+
+	while ( (clean) && (pos<buffer.size()) )
+	  {
+	    eol = buffer.find('\n', pos);
+	    if (eol==string_view::npos)
+	      eol = buffer.size();
+
+	    string_view line = buffer.substr(pos, eol-pos);
+	    command = splitStatLine(line, keysym, value);
+	    switch (command)
+	      {
+	      case 9:
+		save((size_t)value, writer, out);
+		break;
+	      case 7:
+	      case 8:
+		block.typing.push_back(make_pair(command, (time_t)(size_t)value));
+		pending = true;
+		break;
+	      case 1:
+		keys[string(keysym)]+=value;
+		pending = true;
+		break;
+	      default:
+		clean = line.empty();
+	      }
+	    pos = eol+1;
+	  }
+      }
+    file_unmap(data, size);
+    return clean;
+  }
+
+  /* Rollup in place, then the segments it replaces are deleted */
+  bool commit(const string &name, const string &out, const vector<string> &group)
+  {
+    string temp = "."+baseName(name)+".tmp";
+    string journal = temp+"\n"+baseName(name)+"\n";
+    unsigned long long bytes = 0;
+    struct stat st;
+
+    for (unsigned i=0; i<group.size(); ++i)
+      {
+	journal+=baseName(group[i])+"\n";
+	if (stat(group[i].c_str(), &st)==0)
+	  bytes+=st.st_size;
+      }
+
+    if ( (!writeFileSync(dir+"/"+temp, out)) ||
+	 (!writeFileSync(dir+"/"+KC_COMPACT_JOURNAL, journal)) )
+      {
+	unlink((dir+"/"+temp).c_str());
+	unlink((dir+"/"+KC_COMPACT_JOURNAL).c_str());
+	return false;
+      }
+    syncDir(dir);
+    if (rename((dir+"/"+temp).c_str(), name.c_str())<0)
+      {
+	compactLeftovers(dir, true);
+	return false;
+      }
+    syncDir(dir);
+    compactLeftovers(dir, true);
+
+    sources+=group.size();
+    written+=out.size();
+    saved+=bytes;
+    return true;
+  }
+};
+
+GRecorderStats recorderStats;
+
+/* A key press as captured, waiting to be counted by the writer thread */
+struct GKeyEvent
+{
+  time_t when;
+  uint32_t ms;			/* Millisecond clock, only differences matter */
+  int action;
+  unsigned char keycode;
+};
+
+/* A query connection, read and answered without blocking */
+struct GQueryClient
+{
+  int fd;
+  string request;
+  string answer;
+  size_t sent;
+  bool answered;		/* answer is ready, being sent */
+  uint64_t deadline;		/* monotonicNs() it's given up at */
+};
+
+class GEventRecorder : public GKeySink
+{
+public:
+  static GEventRecorder* getInstance()
+  {
+    if (instance==NULL)
+      instance=new GEventRecorder();
+
+    return instance;
+  }
+
+  /* Must be called before the first getInstance() */
+  static void setStoreFormat(int format)
+  {
+    storeFormat = format;
+  }
+
+  /* Key names used when storing data */
+  static void setKeymap(const GKeymap *map)
+  {
+    keymap = map;
+  }
+
+  /* Compact old segments in the background, see KCCompactor */
+  static void setCompact(bool enable)
+  {
+    compact = enable;
+  }
+
+  /**
+   * How much can be lost if we are killed: pending data is committed
+   * every seconds, or as soon as there are keys presses waiting (0 to
+   * commit on time only). Each commit is a single write, and it's also
+   * flushed to disk with fdatasync() if sync is true, so up to seconds
+   * (or keys presses) are lost on a crash. Must be called before the
+   * first getInstance()
+   */
+  static void setCommit(unsigned seconds, unsigned keys, bool sync)
+  {
+    commitTime = seconds;
+    commitKeys = keys;
+    syncCommits = sync;
+  }
+
+  /* Where to store data instead of ~/.keyCounter. Must be called before
+     the first getInstance() */
+  static void setDataDir(const string &dir)
+  {
+    dataDir = dir;
+  }
+
+  /* Keep trigrams too, not only bigrams. Must be called before the
+     first getInstance() */
+  static void setTrigrams(bool enable)
+  {
+    trigrams = enable;
+  }
+
+  /* Events come from the past (replays): typing intervals are closed,
+     and data is saved and stamped, by the time of the events only, never
+     by the clock, so results don't depend on how fast they are queued */
+  static void setEventClock(bool enable)
+  {
+    eventClock = enable;
+  }
+
+  /* Also write every event as it comes to a capture file, to be
+     replayed later (see GReplaySource). Must be called before the first
+     getInstance() */
+  static void setDump(const string &path)
+  {
+    dumpPath = path;
+  }
+
+  /* Called from the capture callback. It only queues the event, counting
+     and storing are done by the writer thread, so a slow disk never
+     stalls the capture */
+  void queueKey(int action, unsigned char keycode, time_t when, uint32_t ms)
+  {
+    recorderStats.captured++;
+    if (!offerKey(action, keycode, when, ms))
+      dropped++;
+  }
+
+  /* Same as queueKey(), but a full queue is not counted as a dropped
+     event: the caller may wait and try again */
+  bool offerKey(int action, unsigned char keycode, time_t when, uint32_t ms)
+  {
+    GKeyEvent ev;
+
+    ev.when = when;
+    ev.ms = ms;
+    ev.action = action;
+    ev.keycode = keycode;
+    if (!events.push(ev))
+      return false;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (writerWaiting.exchange(false))
+      wakeWriter();
+    return true;
+  }
+
+  void startWriter()
+  {
+    writerRunning = true;
+    writer = thread(&GEventRecorder::writerLoop, this);
+    seeder = thread(&GEventRecorder::background, this);
+  }
+
+  /* Counts whatever is still queued and stops the writer thread */
+  void stopWriter()
+  {
+    if (!writer.joinable())
+      return;
+
+    {
+      lock_guard<mutex> lock(backgroundMtx);
+      stopping = true;
+    }
+    backgroundWake.notify_all();
+    seeder.join();
+    writerRunning = false;
+    wakeWriter();
+    writer.join();
+
+    if (listenFd>=0)
+      {
+	close(listenFd);
+	unlink(socketPath.c_str());
+	listenFd = -1;
+      }
+  }
+
+  /* Events lost because the queue was full */
+  unsigned long droppedEvents() const
+  {
+    return dropped;
+  }
+
+  /* Bytes written to the log files */
+  unsigned long long storedBytes() const
+  {
+    return stored;
+  }
+
+  void monitorKey(int, unsigned char keycode, time_t tstamp, uint32_t ms)
+  {
+    if (!typingNow)
+      {
+	typingEvent(8, tstamp);
+	typingNow = true;
+      }
+    else if (lastTimestamp+this->maxIdleTime<tstamp)
+      {
+	// The idle timer didn't fire yet
+	typingEvent(7, lastTimestamp);
+	typingEvent(8, tstamp);
+      }
+    keyTimes[keycode]++;
+    pendingKeys++;
+    lastTimestamp=tstamp;
+
+    if (lastKey>=0)
+      {
+	sequences.pair(lastKey, keycode);
+	if ( (trigrams) && (keyBefore>=0) )
+	  sequences.triple(keyBefore, lastKey, keycode);
+	// Clocks may wrap around (X server time does every 49 days)
+	sequences.interval(ms-lastMs);
+	sequencesChanged = true;
+      }
+    keyBefore = lastKey;
+    lastKey = keycode;
+    lastMs = ms;
+  }
+
+  /* With the event clock: what the timer would have done before an
+     event at when, then when is the time from now on */
+  void advanceClock(time_t when)
+  {
+    time_t due;
+
+    // As if we had started with the first event
+    if (!eventTime)
+      lastStore = when;
+    due = nextTick();
+    if ( (due) && (due<=when) )
+      {
+	eventTime = (due>eventTime)?due:eventTime;
+	tick(eventTime);
+      }
+    eventTime = (when>eventTime)?when:eventTime;
+  }
+
+  /* Time driven work: closes the typing interval once we've been idle
+     long enough and stores pending data when it's due */
+  void tick(time_t now)
+  {
+    if ( (typingNow) && (!eventClock) && (lastTimestamp+this->maxIdleTime<now) )
+      {
+	typingEvent(7, lastTimestamp);
+	typingNow = false;
+      }
+
+    if ( (pendingKeys) || (!typing.empty()) )
+      storeData();
+  }
+
+  /* When tick() has something to do, 0 if nothing will happen until
+     another key is pressed */
+  time_t nextTick()
+  {
+    time_t next = 0;
+
+    if ( (typingNow) && (!eventClock) )
+      next = lastTimestamp+this->maxIdleTime+1;
+
+    if ( ( (pendingKeys) || (!typing.empty()) ) &&
+	 ( (next==0) || (lastStore+minStoreTime<next) ) )
+      next = lastStore+minStoreTime;
+
+    // Enough keys for an early commit, but one was just done
+    if ( (commitKeys) && (pendingKeys>=commitKeys) && (lastStore+1<next) )
+      next = lastStore+1;
+
+    return next;
+  }
+
+private:
+  static GEventRecorder *instance;
+  static int storeFormat;
+  static const GKeymap *keymap;
+  static bool compact;
+  static string dataDir;
+  static string dumpPath;
+  static bool eventClock;
+  static bool trigrams;
+  static unsigned commitTime;
+  static unsigned commitKeys;
+  static bool syncCommits;
+  time_t lastTimestamp;
+  time_t lastStore;
+  time_t eventTime;		/* Event clock: time of the last event */
+  bool typingNow;
+  unsigned pendingKeys;
+  string logPath;
+  unsigned keyTimes[256];	/* Presses since last store, by keycode */
+  vector<pair<int, time_t> > typing; /* (7 stop | 8 start, timestamp) */
+  string currentFile;
+  int logFd;			/* currentFile, open for appending */
+  time_t lastName;		/* Time currentFile is named after */
+  unsigned long long stored;
+  ofstream dump;
+  shared_ptr<const GKeyNames> dumpedNames; /* Keymap already in the dump */
+  string record;		/* Being stored, its buffer is reused */
+  array<string, 256> pressPrefix; /* "1 Press (name) : " by keycode */
+  shared_ptr<const GKeyNames> pressNames; /* Keymap of pressPrefix */
+  KCSequences sequences;	/* Of the current file, saved on every commit */
+  bool sequencesChanged;
+  int lastKey, keyBefore;	/* Last two keycodes of this typing interval */
+  uint32_t lastMs;		/* When lastKey was pressed */
+  KCSegmentWriter segment;
+  time_t started;
+  KCSummary live;		/* Everything stored, to answer queries */
+  shared_ptr<KCSummary> seed;	/* Totals of older data, once read */
+  bool seeded;
+  thread seeder;		/* Seeds totals, then compacts if asked to */
+  mutex backgroundMtx;
+  condition_variable backgroundWake;
+  bool stopping;
+  string socketPath;
+  int listenFd;
+  vector<GQueryClient> clients;	/* Queries in progress */
+
+  GEventRing<GKeyEvent, EVENT_RING_SIZE> events;
+  atomic<unsigned long> dropped;
+  atomic<bool> writerRunning;
+  atomic<bool> writerWaiting;
+  thread writer;
+  int wakeFd;
+  int timerFd;
+
+  unsigned maxIdleTime;
+  unsigned minStoreTime;
+  unsigned maxFileSize;
+
+  GEventRecorder()
+  {
+    short result;
+
+    // Configuration... already manual
+    maxIdleTime = DEFAULT_MAX_IDLE_TIME;
+    minStoreTime = commitTime;
+    maxFileSize = DEFAULT_MAX_FILE_SIZE;
+
+    cerr << "Searching path..." << endl;
+    logPath = dataDirectory(dataDir);
+    result = directory_exists(logPath.c_str());
+    if (result<0)
+      criticalError("Error getting log directory");
+    else if(result==0)
+      {
+	if (createDir (logPath.c_str(), 0744)<0)
+	  criticalError("Error creating log directory");
+      }
+
+    if (!dumpPath.empty())
+      {
+	dump.open(dumpPath.c_str(), ios::trunc);
+	if (!dump.is_open())
+	  criticalError("Can't create capture file "+dumpPath);
+	dump << "# keyCounter capture 1" << endl;
+      }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if ( (wakeFd<0) || (timerFd<0) )
+      criticalError("Can't create writer thread wake up descriptors");
+    dropped = 0;
+    writerRunning = false;
+    writerWaiting = false;
+
+    started = time(NULL);
+    seeded = false;
+    stopping = false;
+    socketPath = logPath+".sock";
+    listenFd = listenSocket(socketPath);
+
+    memset(keyTimes, 0, sizeof(keyTimes));
+    vector<string> files = segmentList(logPath);
+    lastName = (files.empty())?0:atoll(files.back().c_str()+files.back().rfind('/')+1);
+    recoverTail(files);
+    if ( (directory_exists((logPath+".bigrams").c_str())==0) &&
+	 (createDir((logPath+".bigrams").c_str(), 0744)<0) )
+      criticalError("Error creating bigrams directory");
+    sequencesChanged = false;
+    lastKey = keyBefore = -1;
+    lastMs = 0;
+    stored = 0;
+    logFd = -1;
+    eventTime = 0;
+    // With the event clock, files are named after the first save
+    if (!eventClock)
+      createNewFile();
+    lastTimestamp = 0;
+    lastStore = time(NULL);
+    typingNow = false;
+    pendingKeys = 0;
+  }
+
+  ~GEventRecorder()
+  {
+    stopWriter();
+    if (logFd>=0)
+      close(logFd);
+    close(wakeFd);
+    close(timerFd);
+  }
+
+  /* Queries are answered by the writer thread, which owns the totals.
+     A stale socket from a previous run is replaced */
+  static int listenSocket(const string &path)
+  {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (path.size()>=sizeof(addr.sun_path))
+      {
+	cerr << "Socket path too long, queries disabled" << endl;
+	return -1;
+      }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd<0)
+      return -1;
+    unlink(path.c_str());
+    if ( (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0) || (chmod(path.c_str(), 0600)<0) ||
+	 (listen(fd, 16)<0) )
+      {
+	cerr << "Can't listen on "<<path<<", queries disabled" << endl;
+	close(fd);
+	return -1;
+      }
+    return fd;
+  }
+
+  /* Typing marks to store, also kept in the live totals */
+  void typingEvent(int kind, time_t when)
+  {
+    typing.push_back(make_pair(kind, when));
+    // Sequences don't go across idle times
+    if (kind==7)
+      lastKey = keyBefore = -1;
+
+    if (kind==8)
+      {
+	if (live.tail==7)
+	  live.idle.add(when-live.tailSince, live.tailSince);
+	if (!(live.head&KC_HEAD_START))
+	  {
+	    live.head|=KC_HEAD_START;
+	    live.headStart = when;
+	  }
+      }
+    else if (live.tail==8)
+      live.writing.add(when-live.tailSince, live.tailSince);
+    live.tail = kind;
+    live.tailSince = when;
+  }
+
+  /* Totals of the data stored before we started, so queries answer for
+     the whole history. Runs on its own thread, it may take a while */
+  void seedTotals()
+  {
+    KCAnalyzer analyzer;
+    KCTimeRange range;
+    shared_ptr<KCSummary> totals = make_shared<KCSummary>();
+
+    range.until = started-1;
+    analyzer.setDataDir(logPath);
+    analyzer.setVerbose(false);
+    analyzer.setThreads(1);
+    analyzer.setRange(range);
+    analyzer.analyze();
+    analyzer.summary(*totals);
+
+    atomic_store(&seed, totals);
+    wakeWriter();
+  }
+
+  /* Seeding and, from time to time, compaction. Both may take a while
+     and nothing waits for them, so the thread runs with low priority */
+  void background()
+  {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    seedTotals();
+
+    while (compact)
+      {
+	KCCompactor compactor(logPath);
+	if (compactor.run(time(NULL)-DEFAULT_COMPACT_AGE, DEFAULT_ROLLUP_SIZE)<0)
+	  cerr << "Compaction failed, will try again later" << endl;
+
+	unique_lock<mutex> lock(backgroundMtx);
+	if (backgroundWake.wait_for(lock, chrono::seconds(COMPACT_INTERVAL), [&]() { return stopping; }))
+	  return;
+      }
+  }
+
+  /* Older totals go before what we have stored since we started */
+  void addSeed()
+  {
+    shared_ptr<KCSummary> totals = atomic_load(&seed);
+
+    if ( (seeded) || (!totals) )
+      return;
+
+    totals->append(live);
+    live = *totals;
+    seeded = true;
+    atomic_store(&seed, shared_ptr<KCSummary>());
+  }
+
+  /* New query connections. Beyond QUERY_CLIENTS at once they are
+     closed right away */
+  void acceptQueries()
+  {
+    int fd;
+
+    while ( (fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK))>=0 )
+      {
+	if (clients.size()>=QUERY_CLIENTS)
+	  {
+	    close(fd);
+	    continue;
+	  }
+
+	GQueryClient client;
+	client.fd = fd;
+	client.sent = 0;
+	client.answered = false;
+	client.deadline = monotonicNs()+QUERY_TIMEOUT*1000000ULL;
+	clients.push_back(client);
+      }
+  }
+
+  /* Reads the request and sends the answer as far as the client lets us
+     without waiting. Returns false when it's over (answered, closed or
+     too slow), the caller closes it */
+  bool serveQuery(GQueryClient &client)
+  {
+    char data[128];
+    ssize_t len;
+
+    while (!client.answered)
+      {
+	len = read(client.fd, data, sizeof(data));
+	if ( (len<0) && (errno==EINTR) )
+	  continue;
+	if ( (len<0) && (errno==EAGAIN) )
+	  return (monotonicNs()<client.deadline);
+	if (len>0)
+	  client.request.append(data, len);
+	// Whole line, too long to be right, or nothing else will come
+	if ( (len<=0) || (client.request.find('\n')!=string::npos) || (client.request.size()>=128) )
+	  {
+	    client.answer = answerQuery(client.request.substr(0, client.request.find('\n')));
+	    client.answered = true;
+	  }
+      }
+
+    while (client.sent<client.answer.size())
+      {
+	len = send(client.fd, client.answer.data()+client.sent, client.answer.size()-client.sent, MSG_NOSIGNAL);
+	if ( (len<0) && (errno==EINTR) )
+	  continue;
+	if ( (len<0) && (errno==EAGAIN) )
+	  return (monotonicNs()<client.deadline);
+	if (len<=0)
+	  return false;
+	client.sent+=len;
+      }
+    return false;
+  }
+
+  /* Request: "keycount|hourly|burst|state [text|csv|tsv|json]". The
+     report is sent by serveQuery() and the connection closed */
+  string answerQuery(const string &request)
+  {
+    string mode, format, answer;
+
+    stringstream ss(request);
+    ss >> mode >> format;
+    int fmt = (format.empty())?REPORT_TEXT:KCReport::formatFromName(format);
+    if (fmt<0)
+      fmt = REPORT_TEXT;
+
+    {
+      KCReport report(fmt, answer);
+      if (mode=="keycount")
+	queryKeycount(report);
+      else if (mode=="hourly")
+	queryHourly(report);
+      else if (mode=="burst")
+	{
+	  report.begin(summaryColumns("burst", false));
+	  writeSummary("burst", report, "", live);
+	  report.end();
+	}
+      else if (mode=="stats")
+	recorderStats.write(report, dropped);
+      else
+	queryState(report);
+    }
+    return answer;
+  }
+
+  /* Stored totals plus presses not stored yet */
+  void queryKeycount(KCReport &report)
+  {
+    map<string, unsigned, less<> > keys = live.keyTimes;
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+
+    for (unsigned i=0; i<256; ++i)
+      {
+	if (keyTimes[i])
+	  keys[(*names)[i]]+=keyTimes[i];
+      }
+
+    report.begin({"key", "presses"});
+    for (map<string, unsigned, less<> >::iterator i=keys.begin(); i!=keys.end(); ++i)
+      {
+	report.field(i->first);
+	report.field(i->second);
+	report.endRow();
+      }
+    report.end();
+  }
+
+  /* Presses not stored yet go to the current hour */
+  void queryHourly(KCReport &report)
+  {
+    time_t hour = 3600*(clockTime()/3600);
+    bool added = (pendingKeys>0);
+
+    if (added)
+      live.hourly[hour]+=pendingKeys;
+    report.begin(summaryColumns("hourly", false));
+    writeSummary("hourly", report, "", live);
+    report.end();
+    if ( (added) && ((live.hourly[hour]-=pendingKeys)==0) )
+      live.hourly.erase(hour);
+  }
+
+  void queryState(KCReport &report)
+  {
+    time_t now = clockTime();
+
+    report.begin({"state", "since", "seconds"});
+    if (typingNow)
+      {
+	report.field("Typing");
+	report.field(live.tailSince);
+	report.field(now-live.tailSince);
+      }
+    else if (live.tail==7)
+      {
+	report.field("Idle");
+	report.field(live.tailSince);
+	report.field(now-live.tailSince);
+      }
+    else
+      {
+	report.field("Unknown");
+	report.field(0);
+	report.field(0);
+      }
+    report.endRow();
+    report.end();
+  }
+
+  /* Now, for the event clock too */
+  time_t clockTime() const
+  {
+    return (eventClock)?eventTime:time(NULL);
+  }
+
+  void wakeWriter()
+  {
+    uint64_t one = 1;
+
+    if (write(wakeFd, &one, sizeof(one))<0)
+      cerr << "Can't wake up writer thread" << endl;
+  }
+
+  /* Arms the timer for the next tick(), or disarms it, so we don't wake
+     up at all while nobody is typing. The event clock doesn't need it,
+     events move it (see advanceClock()) */
+  void armTimer()
+  {
+    struct itimerspec when;
+
+    memset(&when, 0, sizeof(when));
+    if (!eventClock)
+      when.it_value.tv_sec = nextTick();
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &when, NULL)<0)
+      criticalError("Can't arm writer thread timer");
+  }
+
+  void writerLoop()
+  {
+    GKeyEvent ev;
+    uint64_t count;
+    struct pollfd fds[3+QUERY_CLIENTS];
+
+    fds[0].fd = wakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timerFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = listenFd;	/* Ignored by poll() if -1 */
+    fds[2].events = POLLIN;
+
+    while (true)
+      {
+	unsigned taken = 0;
+	while (events.pop(ev))
+	  {
+	    if (dump.is_open())
+	      dumpEvent(ev);
+	    {
+	      GLatencyTimer timer(recorderStats.monitor);
+	      if (eventClock)
+		advanceClock(ev.when);
+	      monitorKey(ev.action, ev.keycode, ev.when, ev.ms);
+	      // Event by event, so saves don't depend on how they are batched
+	      if (eventClock)
+		tick(eventTime);
+	    }
+	    ++taken;
+	  }
+	if (taken)
+	  recorderStats.batch.add(taken);
+	addSeed();
+
+	if (!writerRunning)
+	  {
+	    // Everything still pending goes to disk before we exit
+	    if (typingNow)
+	      {
+		typingEvent(7, lastTimestamp);
+		typingNow = false;
+	      }
+	    storeData(true);
+	    if (dump.is_open())
+	      dump.close();
+	    for (unsigned i=0; i<clients.size(); ++i)
+	      close(clients[i].fd);
+	    clients.clear();
+	    break;
+	  }
+	tick(clockTime());
+
+	// Tell the producer we're going to sleep, and check again in case
+	// something arrived in between
+	writerWaiting = true;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!events.empty())
+	  {
+	    writerWaiting = false;
+	    continue;
+	  }
+
+	// Queries in progress wake us up too, and their deadlines
+	int timeout = -1;
+	uint64_t now = monotonicNs();
+	for (unsigned i=0; i<clients.size(); ++i)
+	  {
+	    fds[3+i].fd = clients[i].fd;
+	    fds[3+i].events = (clients[i].answered)?POLLOUT:POLLIN;
+	    int left = (clients[i].deadline>now)?(clients[i].deadline-now)/1000000+1:0;
+	    if ( (timeout<0) || (left<timeout) )
+	      timeout = left;
+	  }
+
+	armTimer();
+	if ( (poll(fds, 3+clients.size(), timeout)<0) && (errno!=EINTR) )
+	  criticalError("Writer thread can't wait for events");
+	writerWaiting = false;
+
+	for (unsigned i=0; i<2; ++i)
+	  {
+	    if ( (fds[i].revents & POLLIN) && (read(fds[i].fd, &count, sizeof(count))<0) )
+	      cerr << "Writer thread failed to read a wake up" << endl;
+	  }
+	serveQueries(fds+3, fds[2].revents & POLLIN);
+      }
+  }
+
+  /* Moves every query on as far as it can go, fds are the ones polled
+     for them. Clients that are done, or too slow, are closed */
+  void serveQueries(const struct pollfd *fds, bool incoming)
+  {
+    uint64_t now = monotonicNs();
+    unsigned polled = clients.size();
+    vector<GQueryClient> left;
+
+    for (unsigned i=0; i<polled; ++i)
+      {
+	if ( (!fds[i].revents) && (clients[i].deadline>now) )
+	  left.push_back(clients[i]);
+	else if (serveQuery(clients[i]))
+	  left.push_back(clients[i]);
+	else
+	  close(clients[i].fd);
+      }
+    clients.swap(left);
+
+    // Requests are usually there as soon as they connect
+    if (incoming)
+      {
+	polled = clients.size();
+	acceptQueries();
+	for (unsigned i=polled; i<clients.size(); )
+	  {
+	    if (serveQuery(clients[i]))
+	      ++i;
+	    else
+	      {
+		close(clients[i].fd);
+		clients.erase(clients.begin()+i);
+	      }
+	  }
+      }
+  }
+
+  /* Capture file: "K keycode name" lines with the keymap, again when it
+     changes, and a "when action keycode ms" line for every event */
+  void dumpEvent(const GKeyEvent &ev)
+  {
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+
+    if (names!=dumpedNames)
+      {
+	for (unsigned i=0; i<256; ++i)
+	  {
+	    if ( (!(*names)[i].empty()) && ((*names)[i]!="NoSymbol") )
+	      dump << "K "<<i<<" "<<(*names)[i] << "\n";
+	  }
+	dumpedNames = names;
+      }
+    dump << ev.when<<" "<<ev.action<<" "<<(unsigned)ev.keycode<<" "<<ev.ms << "\n";
+  }
+
+  /* A "prefix value" line at the end of record */
+  void recordLine(string_view prefix, long long value)
+  {
+    char digits[24];
+    to_chars_result res = to_chars(digits, digits+sizeof(digits), value);
+
+    record+=prefix;
+    record.append(digits, res.ptr-digits);
+    record+='\n';
+  }
+
+  /* Text record of everything pending, written straight into record.
+     Line starts of the keys are only built again when the keymap
+     changes */
+  void textRecord(time_t current)
+  {
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+
+    if (names!=pressNames)
+      {
+	for (unsigned i=0; i<256; ++i)
+	  pressPrefix[i] = "1 Press ("+(*names)[i]+") : ";
+	pressNames = names;
+      }
+
+    recordLine("9 Save: ", current);
+    for (unsigned i=0; i<typing.size(); ++i)
+      recordLine((typing[i].first==7)?"7 Stop typing: ":"8 Start typing: ", typing[i].second);
+    for (unsigned i=0; i<256; ++i)
+      {
+	if (keyTimes[i])
+	  recordLine(pressPrefix[i], keyTimes[i]);
+      }
+  }
+
+  string binaryBlock(time_t current)
+  {
+    KCBlock block;
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+
+    block.clear();
+    block.hasSave = true;
+    block.save = current;
+    block.typing = typing;
+    for (unsigned i=0; i<256; ++i)
+      {
+	if (!keyTimes[i])
+	  continue;
+
+	KCKeyCount key;
+	key.id = i;
+	key.presses = keyTimes[i];
+	segment.defineKey(i, (*names)[i]);
+	block.keys.push_back(key);
+      }
+
+    return segment.block(block);
+  }
+
+  /* Group commit: everything pending since the last store is written at
+     once, when it's due or forced to */
+  void storeData(bool force=false)
+  {
+    time_t current = clockTime();
+    struct stat st;
+
+    if ( (!pendingKeys) && (typing.empty()) )
+      return;
+    // Early commits at most once a second, even if writes fail
+    if ( (!force) && (lastStore+minStoreTime>current) &&
+	 ( (!commitKeys) || (pendingKeys<commitKeys) || (lastStore==current) ) )
+      return;
+
+    GLatencyTimer timer(recorderStats.store);
+    if ( (logFd<0) || ( (fstat(logFd, &st)==0) && (st.st_size>maxFileSize) ) )
+      createNewFile();
+
+    KCSegmentWriter previous = segment;
+    if (storeFormat==FORMAT_BINARY)
+      record = binaryBlock(current);
+    else
+      {
+	record.clear();
+	textRecord(current);
+      }
+
+    if (!appendRecord(record))
+      {
+	// Keep it pending, and the segment as it was, to try again
+	cerr << "Can't write "<<currentFile<<": "<<strerror(errno)<<", will retry" << endl;
+	segment = previous;
+	lastStore = current;
+	return;
+      }
+    addStored(current);
+    saveSequences();
+    if (dump.is_open())
+      dump.flush();
+    lastStore=current;
+    pendingKeys=0;
+    typing.clear();
+    memset(keyTimes, 0, sizeof(keyTimes));
+  }
+
+  /* Sequences of the current file go to <data dir>.bigrams, named as
+     the file. They are rewritten on every commit */
+  void saveSequences()
+  {
+    if ( (!sequencesChanged) || (currentFile.empty()) )
+      return;
+
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+    string name = currentFile.substr(currentFile.rfind('/')+1);
+
+    for (unsigned i=0; i<256; ++i)
+      sequences.setName(i, (*names)[i]);
+    if (!sequences.save(logPath+".bigrams/"+name.substr(0, name.find('.'))+".kcq"))
+      cerr << "Can't save bigrams of "<<currentFile << endl;
+    sequencesChanged = false;
+  }
+
+  /* Writes a record with a single write(), so a crash can only leave a
+     torn tail (see recoverTail()). On error the file is left as it was */
+  bool appendRecord(const string &record)
+  {
+    off_t start = lseek(logFd, 0, SEEK_END);
+    size_t done = 0;
+    ssize_t res;
+
+    while (done<record.size())
+      {
+	res = write(logFd, record.data()+done, record.size()-done);
+	if ( (res<0) && (errno==EINTR) )
+	  continue;
+	if (res<=0)
+	  {
+	    int error = errno;
+	    if ( (start>=0) && (ftruncate(logFd, start)<0) )
+	      cerr << "Can't undo a partial write on "<<currentFile << endl;
+	    errno = error;
+	    return false;
+	  }
+	done+=res;
+      }
+    stored+=done;
+
+    // It's written anyway, don't write it twice
+    GLatencyTimer timer(recorderStats.sync);
+    if ( (syncCommits) && (fdatasync(logFd)<0) )
+      cerr << "Can't flush "<<currentFile<<" to disk: "<<strerror(errno) << endl;
+    return true;
+  }
+
+  /* A crash while writing may have left the last segment of the previous
+     run with half a record at its end. It's cut off, so the segment is
+     clean again: for text logs, everything after the last full line, for
+     binary logs, everything after the last valid block */
+  void recoverTail(const vector<string> &files)
+  {
+    const char *data;
+    long long size, good;
+
+    if (files.empty())
+      return;
+
+    size = file_map(&data, files.back().c_str());
+    if (size<=0)
+      return;
+
+    string_view buffer(data, size);
+    if (isBinarySegment(buffer))
+      {
+	KCSegmentReader reader(buffer);
+	KCBlock block;
+
+	while (reader.next(block)>0)
+	  ;
+	good = reader.offset();
+      }
+    else
+      {
+	size_t eol = buffer.rfind('\n');
+	good = (eol==string_view::npos)?0:eol+1;
+      }
+    file_unmap(data, size);
+
+    if (good<size)
+      {
+	if (truncate(files.back().c_str(), good)==0)
+	  cerr << "Dropped "<<size-good<<" bytes of an unfinished record at the end of "<<files.back() << endl;
+	else
+	  cerr << "Can't repair the end of "<<files.back() << endl;
+      }
+  }
+
+  /* Stored presses go to the hour of the save, as when analyzing */
+  void addStored(time_t current)
+  {
+    shared_ptr<const GKeyNames> names = keymap->snapshot();
+    unsigned keys = 0;
+
+    for (unsigned i=0; i<256; ++i)
+      {
+	if (keyTimes[i])
+	  {
+	    live.keyTimes[(*names)[i]]+=keyTimes[i];
+	    ++keys;
+	  }
+      }
+    recorderStats.commits++;
+    recorderStats.coalesced+=pendingKeys-keys;
+    if (pendingKeys)
+      live.hourly[3600*(current/3600)]+=pendingKeys;
+    live.hasHour = true;
+    live.lastHour = 3600*(current/3600);
+  }
+
+  void createNewFile()
+  {
+    GLatencyTimer timer(recorderStats.rotate);
+    stringstream ss;
+    time_t now = clockTime();
+
+    // What is pending goes with the file it was typed in
+    saveSequences();
+    sequences.clear();
+
+    // Files are named after the time they are created, but names must
+    // be unique and in order even if we start two files in a second
+    lastName = (now>lastName)?now:lastName+1;
+    ss<<lastName<<((storeFormat==FORMAT_BINARY)?".kcb":".log");
+    currentFile = logPath+"/"+ss.str();
+
+    if (logFd>=0)
+      close(logFd);
+    logFd = open(currentFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (logFd<0)
+      criticalError("Failed to create file "+currentFile);
+
+    if (storeFormat==FORMAT_BINARY)
+      {
+	segment = KCSegmentWriter();
+	if (!appendRecord(segment.header(now)))
+	  criticalError("Failed to create file "+currentFile);
+      }
+  }
+
+};
+
+GEventRecorder* GEventRecorder::instance=NULL;
+int GEventRecorder::storeFormat=FORMAT_TEXT;
+const GKeymap *GEventRecorder::keymap=NULL;
+bool GEventRecorder::compact=false;
+string GEventRecorder::dataDir;
+string GEventRecorder::dumpPath;
+bool GEventRecorder::eventClock=false;
+bool GEventRecorder::trigrams=false;
+unsigned GEventRecorder::commitTime=DEFAULT_MIN_STORE_TIME;
+unsigned GEventRecorder::commitKeys=0;
+bool GEventRecorder::syncCommits=true;
+
+/* The value of a text log line (after its last ':') has digits, as
+   parseInt() takes anything else as 0 */
+static bool hasNumber(string_view line)
+{
+  size_t pos = line.rfind(':');
+
+  if (pos==string_view::npos)
+    return false;
+  pos = line.find_first_not_of(" \t", pos+1);
+  if ( (pos!=string_view::npos) && ( (line[pos]=='-') || (line[pos]=='+') ) )
+    ++pos;
+  return ( (pos<line.size()) && (line[pos]>='0') && (line[pos]<='9') );
+}
+
+/* Text segment to binary or binary segment to text, depending on what
+   the origin is. Returns 0 on success, -1 if origin can't be read, -2 if
+   destination can't be written, -3 if origin is corrupt, -4 if it was
+   written but skipped text lines couldn't be read */
+int convertSegment(const char *origin, const char *destination, unsigned long &skipped)
+{
+  const char *data;
+  long long size;
+  string out;
+  int res = 0;
+
+  skipped = 0;
+  size = file_map(&data, origin);
+  if (size<0)
+    return -1;
+
+  string_view buffer(data, size);
+  if (isBinarySegment(buffer))
+    {
+      KCSegmentReader reader(buffer);
+      KCBlock block;
+
+      while ( (res=reader.next(block))>0 )
+	{
+	  if (block.hasSave)
+	    out+="9 Save: "+to_string(block.save)+"\n";
+	  for (unsigned i=0; i<block.typing.size(); ++i)
+	    out+=((block.typing[i].first==7)?"7 Stop typing: ":"8 Start typing: ")+
+	      to_string(block.typing[i].second)+"\n";
+	  for (unsigned i=0; i<block.keys.size(); ++i)
+	    out+="1 Press ("+reader.keyName(block.keys[i].id)+") : "+
+	      to_string(block.keys[i].presses)+"\n";
+	}
+    }
+  else
+    {
+      KCSegmentWriter writer;
+      KCBlock block;
+      size_t pos = 0, eol;
+      string_view keysym;
+      int command, value;
+      bool pending = false;
+      const char *name = strrchr(origin, '/');
+
+      block.clear();
+      out = writer.header(atoll((name)?name+1:origin));
+      while (pos<buffer.size())
+	{
+	  eol = buffer.find('\n', pos);
+	  if (eol==string_view::npos)
+	    eol = buffer.size();
+
+	  string_view line = buffer.substr(pos, eol-pos);
+	  command = splitStatLine(line, keysym, value);
+	  if ( (command) && (!hasNumber(line)) )
+	    command = 0;
+	  switch (command)
+	    {
+	    case 9:
+	      if (pending)
+		out+=writer.block(block);
+	      block.clear();
+	      block.hasSave = true;
+	      block.save = (size_t)value;
+	      break;
+	    case 7:
+	    case 8:
+	      block.typing.push_back(make_pair(command, (time_t)(size_t)value));
+	      break;
+	    case 1:
+	      {
+		KCKeyCount key;
+		key.id = writer.keyId(string(keysym));
+		key.presses = value;
+		block.keys.push_back(key);
+	      }
+	      break;
+	    default:
+	      if (eol>pos)
+		++skipped;
+	    }
+	  pending = ( (block.hasSave) || (!block.typing.empty()) || (!block.keys.empty()) );
+	  pos = eol+1;
+	}
+      if (pending)
+	out+=writer.block(block);
+    }
+  file_unmap(data, size);
+
+  if (res<0)
+    return -3;
+
+  ofstream of(destination, ios::trunc | ios::binary);
+  if (!of.is_open())
+    return -2;
+  of << out;
+  of.close();
+
+  if (of.fail())
+    return -2;
+  return (skipped)?-4:0;
+}
+
+void captureKeys(GInputSource &source)
+{
+  int signalFd;
+  sigset_t signals;
+
+  // Exit signals are read from a descriptor by the capture loop. Block
+  // them before any thread is created so no other thread gets them
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (signalFd<0)
+    criticalError("Can't create signal descriptor");
+  // Query clients may hang up before reading the answer
+  signal(SIGPIPE, SIG_IGN);
+
+  source.open();
+  GEventRecorder::setKeymap(source.keyNames());
+
+  GEventRecorder::getInstance()->startWriter();
+  source.run(GEventRecorder::getInstance(), signalFd);
+  // Stores whatever is pending, no need to wait for the next commit
+  GEventRecorder::getInstance()->stopWriter();
+  close(signalFd);
+
+  cerr << "Exiting... " << endl;
+}
+
+/* "--name=value" arguments */
+bool optionValue(const string &arg, const string &name, string &value)
+{
+  if (arg.compare(0, name.size()+3, "--"+name+"=")!=0)
+    return false;
+
+  value = arg.substr(name.size()+3);
+  return true;
+}
+
+/* Sizes like "100000", "10Mb" or "2Gb" */
+long long sizeValue(const string &value)
+{
+  if (value.find_first_not_of("0123456789")==string::npos)
+    return atoll(value.c_str());
+
+  return human_to_bytes(value.c_str());
+}
+
+/* Timestamps or local dates like "2020-01-31", "2020-01-31 18:30" or
+   "2020-01-31 18:30:15" */
+time_t timeValue(const string &value)
+{
+  const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+  struct tm tm;
+
+  if ( (!value.empty()) && (value.find_first_not_of("0123456789")==string::npos) )
+    return atoll(value.c_str());
+
+  for (unsigned i=0; i<sizeof(formats)/sizeof(formats[0]); ++i)
+    {
+      memset(&tm, 0, sizeof(tm));
+      const char *end = strptime(value.c_str(), formats[i], &tm);
+      if ( (end) && (*end=='\0') )
+	{
+	  tm.tm_isdst = -1;
+	  return mktime(&tm);
+	}
+    }
+  criticalError("Wrong date "+value+", try YYYY-MM-DD HH:MM");
+  return 0;
+}
+
+/* Adds all the sequence files saved by the recorder in range, next to
+   dataDir (~/.keyCounter if empty) as it does. Each file spans from its
+   name to the next one, the last one until it was modified */
+void loadSequences(const string &dataDir, const KCTimeRange &range, KCSequenceTotals &totals)
+{
+  string dir = dataDirectory(dataDir)+".bigrams";
+  vector<string> files;
+  KCSequences sequences;
+  DIR *d;
+  struct dirent *ent;
+  struct stat st;
+
+  d = opendir(dir.c_str());
+  if (d == NULL)
+    criticalError("Can't open bigrams directory "+dir+", was the recorder ever run?");
+  while ((ent = readdir(d)) != NULL)
+    {
+      size_t len = strlen(ent->d_name);
+      if ( (len>4) && (strcmp(ent->d_name+len-4, ".kcq")==0) )
+	files.push_back(dir+"/"+ent->d_name);
+    }
+  closedir(d);
+  sort(files.begin(), files.end(), segmentOrder);
+
+  for (size_t i=0; i<files.size(); ++i)
+    {
+      time_t start = atoll(files[i].c_str()+files[i].rfind('/')+1);
+      time_t end = (i+1<files.size())?atoll(files[i+1].c_str()+files[i+1].rfind('/')+1):
+	( (stat(files[i].c_str(), &st)==0)?st.st_mtime:start );
+
+      if ( (start>range.until) || (end<range.since) )
+	continue;
+      if (sequences.load(files[i])<0)
+	{
+	  cerr << "Skipping corrupt bigrams file "<<files[i] << endl;
+	  continue;
+	}
+      totals.add(sequences);
+    }
+}
+
+/* Bigrams (or trigrams) typed in range */
+void sequenceReport(KCReport &report, const string &dataDir, const KCTimeRange &range, bool trigrams,
+		    size_t limit)
+{
+  KCSequenceTotals totals;
+
+  loadSequences(dataDir, range, totals);
+  vector<KCSequenceTotals::Entry> entries = (trigrams)?totals.trigrams(limit):totals.bigrams(limit);
+  if (trigrams)
+    report.begin({ "first", "second", "third", "presses" });
+  else
+    report.begin({ "first", "second", "presses" });
+  for (unsigned i=0; i<entries.size(); ++i)
+    {
+      for (unsigned k=0; k<((trigrams)?3u:2u); ++k)
+	report.field(entries[i].keys[k]);
+      report.field((unsigned long)entries[i].presses);
+      report.endRow();
+    }
+  report.end();
+
+  if ( (trigrams) && (totals.lostTriples()) )
+    cerr << totals.lostTriples()<<" trigrams not counted, their tables were full" << endl;
+}
+
+/* Milliseconds between consecutive keys while typing (pauses are not
+   included) and the typing speed they give, or their histogram */
+void speedReport(KCReport &report, const string &dataDir, const KCTimeRange &range, bool histogram)
+{
+  KCSequenceTotals totals;
+  const KCHistogram &intervals = totals.intervals();
+
+  loadSequences(dataDir, range, totals);
+  if (histogram)
+    {
+      report.begin({ "from", "to", "intervals" });
+      for (unsigned i=0; i<KC_HISTOGRAM_BUCKETS; ++i)
+	{
+	  if (!intervals.at(i))
+	    continue;
+	  report.field(KCHistogram::lowerBound(i));
+	  report.field(KCHistogram::upperBound(i));
+	  report.field(intervals.at(i));
+	  report.endRow();
+	}
+      report.end();
+      return;
+    }
+
+  report.begin({ "intervals", "keys_per_minute", "mean", "p10", "median", "p90", "p99" });
+  if (intervals.count())
+    {
+      report.field(intervals.count());
+      report.field((unsigned long)(intervals.count()*60000/(std::max)(totals.intervalTotal(), (uint64_t)1)));
+      report.field((unsigned long)(totals.intervalTotal()/intervals.count()));
+      report.field(intervals.quantile(0.1));
+      report.field(intervals.quantile(0.5));
+      report.field(intervals.quantile(0.9));
+      report.field(intervals.quantile(0.99));
+      report.endRow();
+    }
+  report.end();
+}
+
+/* Many reports (comma separated names) from a single pass over the logs,
+   each in its own section. quiet leaves out the burst extremes */
+void allReports(KCAnalyzer &analyzer, KCReport &report, const string &reports, bool quiet=false)
+{
+  const char *known[] = { "keycount", "burst", "histogram", "intervals", "hourly", "daily", "weekly", "heatmap" };
+  vector<string> names;
+  size_t start = 0, comma;
+
+  do
+    {
+      comma = reports.find(',', start);
+      string name = reports.substr(start, (comma==string::npos)?string::npos:comma-start);
+      if (find(begin(known), end(known), name)==end(known))
+	criticalError("Unknown report "+name+", try keycount, burst, histogram, intervals, hourly, daily, weekly or heatmap");
+      names.push_back(name);
+      start = comma+1;
+    } while (comma!=string::npos);
+
+  // Intervals are written while the files are read, so they go first
+  vector<unique_ptr<KCRecordConsumer> > owned;
+  vector<KCRecordConsumer*> consumers;
+  bool bursts = false;
+  if (find(names.begin(), names.end(), "intervals")!=names.end())
+    {
+      report.section("intervals");
+      owned.emplace_back(new KCIntervalLog(report));
+      consumers.push_back(owned.back().get());
+      bursts = true;
+    }
+
+  // The others are written when everything has been read
+  vector<pair<string, KCRecordConsumer*> > sections;
+  for (unsigned i=0; i<names.size(); ++i)
+    {
+      if (names[i]=="intervals")
+	continue;
+      if (names[i]=="keycount")
+	owned.emplace_back(new KCKeyReport(report));
+      else if ( (names[i]=="burst") || (names[i]=="histogram") )
+	{
+	  owned.emplace_back(new KCBurstReport(report, (names[i]=="burst")?BURST_SUMMARY:BURST_HISTOGRAM));
+	  bursts = true;
+	}
+      else if (names[i]=="hourly")
+	owned.emplace_back(new KCTimeReport(report, TIME_HOURLY));
+      else if (names[i]=="daily")
+	owned.emplace_back(new KCTimeReport(report, TIME_DAILY));
+      else if (names[i]=="weekly")
+	owned.emplace_back(new KCTimeReport(report, TIME_WEEKLY));
+      else
+	owned.emplace_back(new KCTimeReport(report, TIME_HEATMAP));
+      sections.push_back(make_pair(names[i], owned.back().get()));
+    }
+
+  for (unsigned i=0; i<sections.size(); ++i)
+    consumers.push_back(sections[i].second);
+  analyzer.feed(consumers);
+
+  if (consumers.size()>sections.size())
+    consumers[0]->finish();
+  for (unsigned i=0; i<sections.size(); ++i)
+    {
+      report.section(sections[i].first);
+      sections[i].second->finish();
+    }
+  if ( (bursts) && (!quiet) )
+    analyzer.burstExtremes();
+}
+
+void analyzeData(int argc, char *argv[])
+{
+  KCAnalyzer analyzer;
+  KCTimeRange range;
+  int format = REPORT_TEXT;
+  string mode, value, summaryFile, dataDir;
+  string reports = "keycount,burst,hourly,daily,weekly,heatmap";
+  int burstOutput = BURST_SUMMARY;
+  bool trigrams = false;
+  size_t limit = 0;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "emit-summary", value))
+	summaryFile = value;
+      else if (optionValue(arg, "dir", value))
+	dataDir = value;
+      else if (arg=="--intervals")
+	burstOutput = BURST_INTERVALS;
+      else if (arg=="--histogram")
+	burstOutput = BURST_HISTOGRAM;
+      else if (arg=="--trigrams")
+	trigrams = true;
+      else if (optionValue(arg, "limit", value))
+	limit = atoll(value.c_str());
+      else if (optionValue(arg, "reports", value))
+	reports = value;
+      else if (arg.compare(0, 9, "--format=")==0)
+	{
+	  format = KCReport::formatFromName(arg.substr(9));
+	  if (format<0)
+	    criticalError("Unknown format "+arg.substr(9)+", try text, csv, tsv or json");
+	}
+      else if (optionValue(arg, "since", value))
+	range.since = timeValue(value);
+      else if (optionValue(arg, "until", value))
+	range.until = timeValue(value);
+      else
+	mode = arg;
+    }
+  if (range.since>range.until)
+    criticalError("--since must be before --until");
+  analyzer.setRange(range);
+  if (!dataDir.empty())
+    analyzer.setDataDir(dataDir);
+
+  KCReport report(format);
+  if (mode=="keycount")
+    analyzer.keycount(report);
+  else if (mode=="burst")
+    analyzer.burst(report, burstOutput);
+  else if (mode=="hourly")
+    analyzer.hourlyLog(report);
+  else if ( (mode=="daily") || (mode=="weekly") )
+    analyzer.periodLog(report, mode=="weekly");
+  else if (mode=="heatmap")
+    analyzer.heatmap(report);
+  else if (mode=="bigrams")
+    sequenceReport(report, dataDir, range, trigrams, limit);
+  else if (mode=="speed")
+    speedReport(report, dataDir, range, burstOutput==BURST_HISTOGRAM);
+  else if (mode=="all")
+    allReports(analyzer, report, reports);
+  else if ( (mode.empty()) && (!summaryFile.empty()) )
+    analyzer.analyze();
+  else
+    {
+      cerr << "Plase try to analyze with these options: "<<endl;
+      cerr << "   "<<argv[0]<<" analyze keycount - To check wich are the most used keys"<<endl;
+      cerr << "   "<<argv[0]<<" analyze burst - To check typing pauses"<<endl;
+      cerr << "      add --histogram for their histogram or --intervals for every one of them"<<endl;
+      cerr << "   "<<argv[0]<<" analyze hourly - To check hourly stats"<<endl;
+      cerr << "   "<<argv[0]<<" analyze daily|weekly - To check presses by day or week"<<endl;
+      cerr << "   "<<argv[0]<<" analyze heatmap - To check presses by day of the week and hour"<<endl;
+      cerr << "   "<<argv[0]<<" analyze bigrams - To check which keys are typed one after another"<<endl;
+      cerr << "      add --trigrams for three keys (if recorded with --trigrams), --limit=N for the first N"<<endl;
+      cerr << "   "<<argv[0]<<" analyze speed - To check typing speed and milliseconds between keys"<<endl;
+      cerr << "      add --histogram for the histogram of those milliseconds"<<endl;
+      cerr << "   "<<argv[0]<<" analyze all - Many reports reading the logs once"<<endl;
+      cerr << "      add --reports=keycount,burst,histogram,intervals,hourly,daily,weekly,heatmap to choose them"<<endl;
+      cerr << "Add --format=csv, --format=tsv or --format=json for other output formats"<<endl;
+      cerr << "Add --since=\"YYYY-MM-DD HH:MM\" and/or --until=... (or timestamps) to analyze only that time"<<endl;
+      cerr << "Add --dir=directory to analyze data recorded there (as with record --dir)"<<endl;
+      cerr << "Add --emit-summary=file.kcs to write a summary to be merged with others"<<endl;
+      return;
+    }
+
+  if (!summaryFile.empty())
+    {
+      KCSummary summary;
+      analyzer.summary(summary);
+      if (!summary.save(summaryFile))
+	criticalError("Can't write summary "+summaryFile);
+    }
+}
+
+/* Summaries are unrelated (other users) unless --sequential is given:
+   then they are consecutive times of the same data, in order */
+void mergeData(int argc, char *argv[])
+{
+  vector<string> inputs;
+  bool sequential = false;
+  KCSummary total, summary;
+
+  for (int i=2; i<argc; ++i)
     {
-      XRecordProcessReplies(RecDpy);
-      usleep(1000);
+      string arg = argv[i];
+      if (arg=="--sequential")
+	sequential = true;
+      else
+	inputs.push_back(arg);
+    }
+
+  if (inputs.size()<2)
+    {
+      cerr << "Please tell me where to write and what to merge: "<<endl;
+      cerr << "   "<<argv[0]<<" merge output.kcs input.kcs... [--sequential]"<<endl;
+      return;
+    }
+
+  for (unsigned i=1; i<inputs.size(); ++i)
+    {
+      int res = summary.load(inputs[i]);
+      if (res==-1)
+	criticalError("Can't read "+inputs[i]);
+      else if (res<0)
+	criticalError(inputs[i]+" is not a valid summary");
+
+      if (i==1)
+	total = summary;
+      else if (!sequential)
+	total.add(summary);
+      else if (!total.append(summary))
+	criticalError("Can't append "+inputs[i]+", summaries of unrelated data can't be merged sequentially");
     }
 
-  sret=XRecordDisableContext(LocalDpy, rc);
-  if (!sret) cerr << "XRecordDisableContext failed!" << endl;
-  sret=XRecordFreeContext(LocalDpy, rc);
-  if (!sret) cerr << "XRecordFreeContext failed!" << endl;
-  XFree(rr);
+  if (!total.save(inputs[0]))
+    criticalError("Can't write summary "+inputs[0]);
 }
 
+void summaryData(int argc, char *argv[])
+{
+  int format = REPORT_TEXT;
+  string mode, file, value;
+  bool histogram = false;
+  KCSummary summary;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "format", value))
+	{
+	  format = KCReport::formatFromName(value);
+	  if (format<0)
+	    criticalError("Unknown format "+value+", try text, csv, tsv or json");
+	}
+      else if (arg=="--histogram")
+	histogram = true;
+      else if (mode.empty())
+	mode = arg;
+      else
+	file = arg;
+    }
+
+  if ( ( (mode!="keycount") && (mode!="hourly") && (mode!="burst") ) || (file.empty()) )
+    {
+      cerr << "Please tell me what to show and from where: "<<endl;
+      cerr << "   "<<argv[0]<<" summary keycount|hourly|burst file.kcs [--histogram] [--format=csv]"<<endl;
+      return;
+    }
+
+  int res = summary.load(file);
+  if (res==-1)
+    criticalError("Can't read "+file);
+  else if (res<0)
+    criticalError(file+" is not a valid summary");
+
+  KCReport report(format);
+  if ( (mode=="burst") && (histogram) )
+    mode = "histogram";
+  report.begin(summaryColumns(mode, false));
+  writeSummary(mode, report, "", summary);
+  report.end();
+}
 
-void do_exit(int s)
+void fleetData(int argc, char *argv[])
 {
-  Exit_signal = 1;
+  vector<string> roots;
+  KCTimeRange range;
+  int format = REPORT_TEXT;
+  unsigned jobs = 0;
+  string mode, value;
+  bool histogram = false;
+  glob_t found;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "format", value))
+	{
+	  format = KCReport::formatFromName(value);
+	  if (format<0)
+	    criticalError("Unknown format "+value+", try text, csv, tsv or json");
+	}
+      else if (optionValue(arg, "jobs", value))
+	jobs = atoi(value.c_str());
+      else if (optionValue(arg, "since", value))
+	range.since = timeValue(value);
+      else if (optionValue(arg, "until", value))
+	range.until = timeValue(value);
+      else if (arg=="--histogram")
+	histogram = true;
+      else if (mode.empty())
+	mode = arg;
+      else if (glob(arg.c_str(), GLOB_TILDE | GLOB_BRACE, NULL, &found)==0)
+	{
+	  for (size_t j=0; j<found.gl_pathc; ++j)
+	    {
+	      if (directory_exists(found.gl_pathv[j])==1)
+		roots.push_back(found.gl_pathv[j]);
+	      else
+		cerr << "Skipping "<<found.gl_pathv[j]<<", not a directory"<<endl;
+	    }
+	  globfree(&found);
+	}
+      else
+	cerr << "Nothing found in "<<arg<<endl;
+    }
+
+  if ( ( (mode!="keycount") && (mode!="hourly") && (mode!="burst") ) || (roots.empty()) )
+    {
+      cerr << "Please tell me what to analyze and where: "<<endl;
+      cerr << "   "<<argv[0]<<" fleet keycount|hourly|burst directory... [--histogram] [--jobs=N] [--format=csv]"<<endl;
+      cerr << "Directories may be globs like \"/data/*/.keyCounter\". --since and --until work as in analyze"<<endl;
+      return;
+    }
+  if (range.since>range.until)
+    criticalError("--since must be before --until");
+
+  if ( (mode=="burst") && (histogram) )
+    mode = "histogram";
+
+  KCReport report(format);
+  KCFleet(roots, range, jobs).run(mode, report);
 }
 
-void captureKeys()
+/* Asks the recorder running on dataDir (see dataDirectory()), without
+   reading any log. Its answer goes to stdout */
+void askRecorder(string request, const string &format, const string &dataDir)
 {
-  int Major, Minor;
+  struct sockaddr_un addr;
+  string path = dataDirectory(dataDir)+".sock";
+  char buffer[4096];
+  ssize_t len;
+  int fd;
+
+  if (!format.empty())
+    request+=" "+format;
+  request+="\n";
 
-  signal (SIGINT, do_exit);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( (fd<0) || (connect(fd, (struct sockaddr*)&addr, sizeof(addr))<0) )
+    criticalError("Can't connect to the recorder, is it running?");
 
-  // open the local display twice
-  Display * LocalDpy = localDisplay ();
-  Display * RecDpy = localDisplay ();
+  if (write(fd, request.data(), request.size())!=(ssize_t)request.size())
+    criticalError("Can't send the query");
+  while ( (len = read(fd, buffer, sizeof(buffer)))>0 )
+    {
+      if (write(1, buffer, len)!=len)
+	break;
+    }
+  close(fd);
+}
 
-  // get the screens too
-  int LocalScreen  = DefaultScreen ( LocalDpy );
+void queryData(int argc, char *argv[])
+{
+  string request, value, format, dir;
 
-  if ( ! XRecordQueryVersion (RecDpy, &Major, &Minor ) ) 
+  for (int i=2; i<argc; ++i)
     {
-      // nope, extension not supported
-      XCloseDisplay ( RecDpy );
-      criticalError((string)"XRecord extension not supported on server \"" + (string) DisplayString(RecDpy) + (string)"\"");
+      string arg = argv[i];
+      if (optionValue(arg, "format", value))
+	{
+	  if (KCReport::formatFromName(value)<0)
+	    criticalError("Unknown format "+value+", try text, csv, tsv or json");
+	  format = value;
+	}
+      else if (optionValue(arg, "dir", value))
+	dir = value;
+      else
+	request = arg;
     }
 
-  // print some information
-  cerr << "XRecord for server \"" << DisplayString(RecDpy) << "\" is version "
-           << Major << "." << Minor << "." << endl << endl;;
+  if ( (request!="keycount") && (request!="hourly") && (request!="burst") && (request!="state") &&
+       (request!="stats") )
+    {
+      cerr << "Please tell me what to ask the recorder: "<<endl;
+      cerr << "   "<<argv[0]<<" query keycount|hourly|burst|state|stats [--format=csv] [--dir=directory]"<<endl;
+      return;
+    }
+  askRecorder(request, format, dir);
+}
 
-  eventLoop ( LocalDpy, LocalScreen, RecDpy);
+/* Latencies and counters of the running recorder (also written to its
+   stderr on SIGUSR1) */
+void statsData(int argc, char *argv[])
+{
+  string value, format = "tsv", dir;
 
-  cerr << "Exiting... " << endl;
-  // Mirar si tengo que grabar algo mas
-  XCloseDisplay ( LocalDpy );
+  for (int i=2; i<argc; ++i)
+    {
+      if (optionValue(argv[i], "dir", value))
+	{
+	  dir = value;
+	  continue;
+	}
+      if (!optionValue(argv[i], "format", value))
+	criticalError((string)"Unknown option "+argv[i]+", try --format=text|csv|tsv|json or --dir=directory");
+      if (KCReport::formatFromName(value)<0)
+	criticalError("Unknown format "+value+", try text, csv, tsv or json");
+      format = value;
+    }
+  askRecorder("stats", format, dir);
 }
 
-void analyzeData(int argc, char *argv[])
+void recordData(int argc, char *argv[])
 {
-  KCAnalyzer analyzer;
+  unsigned commitTime = DEFAULT_MIN_STORE_TIME, commitKeys = 0;
+  bool sync = true, evdev = false;
+  vector<string> devices;
+  string value;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (arg=="--compact")
+	GEventRecorder::setCompact(true);
+      else if (optionValue(arg, "commit", value))
+	commitTime = atoi(value.c_str());
+      else if (optionValue(arg, "commit-keys", value))
+	commitKeys = atoi(value.c_str());
+      else if (arg=="--no-sync")
+	sync = false;
+      else if (optionValue(arg, "dump", value))
+	GEventRecorder::setDump(value);
+      else if (arg=="--evdev")
+	evdev = true;
+      else if (arg=="--trigrams")
+	GEventRecorder::setTrigrams(true);
+      else if (optionValue(arg, "device", value))
+	devices.push_back(value);
+      else if (arg=="binary")
+	GEventRecorder::setStoreFormat(FORMAT_BINARY);
+      else if (arg!="text")
+	criticalError("Unknown log format, try 'text' or 'binary'");
+    }
+  GEventRecorder::setCommit(commitTime, commitKeys, sync);
 
-  if (argc>2)
+  if ( (evdev) || (!devices.empty()) )
     {
-      if ( (string)argv[2]=="keycount")
-	cout << analyzer.keycount() << endl;
-      else if ( (string)argv[2]=="burst")
-	cout << analyzer.burst() << endl;
-      else if ( (string)argv[2]=="hourly")
-	cout << analyzer.hourlyLog() << endl;
+      GEvdevSource source(devices);
+      captureKeys(source);
     }
   else
     {
-      cerr << "Plase try to analyze with these options: "<<endl;
-      cerr << "   "<<argv[0]<<" analyze keycount - To check wich are the most used keys"<<endl;
-      cerr << "   "<<argv[0]<<" analyze burst - To check typing pauses"<<endl;
-      cerr << "   "<<argv[0]<<" analyze hourly - To check hourly stats"<<endl;
+      GXRecordSource source;
+      captureKeys(source);
+    }
+}
+
+/* Records a capture file again, to measure how fast the recorder is and
+   how much it stores, or to check it still stores the same */
+void replayData(int argc, char *argv[])
+{
+  string file, value;
+  unsigned rate = 0;
+  bool evdev = false;
+  struct timespec start, end;
+  GEventRecorder *recorder;
+  unique_ptr<GInputSource> source;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "rate", value))
+	rate = atoi(value.c_str());
+      else if (optionValue(arg, "dir", value))
+	GEventRecorder::setDataDir(value);
+      else if (arg=="binary")
+	GEventRecorder::setStoreFormat(FORMAT_BINARY);
+      else if (arg=="text")
+	GEventRecorder::setStoreFormat(FORMAT_TEXT);
+      else if (arg=="--evdev")
+	evdev = true;
+      else if (arg=="--trigrams")
+	GEventRecorder::setTrigrams(true);
+      else
+	file = arg;
+    }
+  if (file.empty())
+    {
+      cerr << "Please tell me what to replay: "<<endl;
+      cerr << "   "<<argv[0]<<" replay capture [text|binary] [--rate=events/s] [--dir=directory] [--trigrams]"<<endl;
+      cerr << "   "<<argv[0]<<" replay evdev_dump --evdev [text|binary] [--dir=directory]"<<endl;
+      return;
+    }
+
+  GEventRecorder::setEventClock(true);
+  if (evdev)
+    source.reset(new GEvdevSource(vector<string>(1, file)));
+  else
+    source.reset(new GReplaySource(file, rate));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  captureKeys(*source);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+  recorder = GEventRecorder::getInstance();
+  cerr << "Replayed "<<source->events()<<" events in "<<seconds<<"s ("
+       << (unsigned long)((seconds>0)?source->events()/seconds:0)<<" events/s), "
+       << recorder->droppedEvents()<<" dropped, queue full "<<source->fullQueue()<<" times, "
+       << recorder->storedBytes()<<" bytes stored" << endl;
+}
+
+void generateData(int argc, char *argv[])
+{
+  KCGenerateOptions options;
+  string value;
+  long segments;
+
+  if (argc<3)
+    {
+      cerr << "Please tell me where to write: "<<endl;
+      cerr << "   "<<argv[0]<<" generate directory [--size=10Mb] [--segment=100000] [--seed=1]"<<endl;
+      cerr << "      [--zipf=1.1] [--speed=240] [--burst=300] [--idle=900] [--binary]"<<endl;
+      cerr << "   Writes synthetic logs: total size, segment size, random seed, key skew,"<<endl;
+      cerr << "   keys per minute, mean typing burst and idle time in seconds"<<endl;
+      return;
+    }
+
+  options.dir = argv[2];
+  for (int i=3; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "size", value))
+	options.bytes = sizeValue(value);
+      else if (optionValue(arg, "segment", value))
+	options.segmentBytes = sizeValue(value);
+      else if (optionValue(arg, "seed", value))
+	options.seed = strtoull(value.c_str(), NULL, 10);
+      else if (optionValue(arg, "zipf", value))
+	options.zipf = atof(value.c_str());
+      else if (optionValue(arg, "speed", value))
+	options.keysPerMinute = atoi(value.c_str());
+      else if (optionValue(arg, "burst", value))
+	options.burstMean = atoi(value.c_str());
+      else if (optionValue(arg, "idle", value))
+	options.idleMean = atoi(value.c_str());
+      else if (arg=="--binary")
+	options.binary = true;
+      else
+	criticalError("Unknown option "+arg);
+    }
+
+  segments = generateLogs(options);
+  if (segments==-1)
+    criticalError("Can't create directory "+options.dir);
+  else if (segments<0)
+    criticalError("Can't write logs in "+options.dir);
+
+  cerr << segments << " segments written in "<<options.dir<<endl;
+}
+
+struct KCBenchResult
+{
+  double seconds;		/* Best run */
+  long rss;			/* Peak RSS, Kb */
+};
+
+double secondsSince(const struct timespec &start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start.tv_sec)+(now.tv_nsec-start.tv_nsec)/1e9;
+}
+
+/* Runs a benchmark in a child process, so its peak RSS is its own */
+bool runBenchmark(const string &mode, const string &dir, const vector<string> &files,
+		  unsigned runs, KCBenchResult &result)
+{
+  int fds[2];
+  pid_t pid;
+  int status;
+
+  if (pipe(fds)<0)
+    return false;
+
+  pid = fork();
+  if (pid<0)
+    return false;
+
+  if (pid==0)
+    {
+      struct rusage usage;
+      struct timespec start;
+      double seconds;
+      int devnull = open("/dev/null", O_WRONLY);
+
+      close(fds[0]);
+      dup2(devnull, 2);		/* burst summary and parse warnings */
+      result.seconds = -1;
+      for (unsigned r=0; r<runs; ++r)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  if (mode=="parse")
+	    {
+	      // Parser alone, single thread, no merge
+	      for (unsigned i=0; i<files.size(); ++i)
+		{
+		  KCFileStats stats;
+		  stats.name = files[i];
+		  KCLogParser(stats).parseFile();
+		}
+	    }
+	  else if (mode=="split")
+	    {
+	      // Just splitting text lines into fields
+	      for (unsigned i=0; i<files.size(); ++i)
+		{
+		  const char *data;
+		  long long size = file_map(&data, files[i].c_str());
+		  string_view buffer(data, (size>0)?size:0), keysym;
+		  size_t pos = 0, eol;
+		  int value;
+
+		  while (pos<buffer.size())
+		    {
+		      eol = buffer.find('\n', pos);
+		      if (eol==string_view::npos)
+			eol = buffer.size();
+		      splitStatLine(buffer.substr(pos, eol-pos), keysym, value);
+		      pos = eol+1;
+		    }
+		  file_unmap(data, size);
+		}
+	    }
+	  else if (mode=="scan")
+	    {
+	      // Same, with the SIMD scanner
+	      for (unsigned i=0; i<files.size(); ++i)
+		{
+		  const char *data;
+		  long long size = file_map(&data, files[i].c_str());
+		  KCLineScanner scanner(string_view(data, (size>0)?size:0));
+		  KCStatLine line;
+
+		  while (scanner.next(line))
+		    ;
+		  file_unmap(data, size);
+		}
+	    }
+	  else
+	    {
+	      KCAnalyzer analyzer;
+	      KCReport sink(REPORT_TEXT, devnull);
+
+	      analyzer.setDataDir(dir);
+	      analyzer.setCache(false);
+	      analyzer.setVerbose(false);
+	      if (mode=="keycount")
+		analyzer.keycount(sink);
+	      else if (mode=="burst")
+		analyzer.burst(sink, BURST_INTERVALS);
+	      else
+		analyzer.hourlyLog(sink);
+	    }
+	  seconds = secondsSince(start);
+	  if ( (result.seconds<0) || (seconds<result.seconds) )
+	    result.seconds = seconds;
+	}
+
+      getrusage(RUSAGE_SELF, &usage);
+      result.rss = usage.ru_maxrss;
+      if (write(fds[1], &result, sizeof(result))!=sizeof(result))
+	_exit(EXIT_FAILURE);
+      _exit(EXIT_SUCCESS);
+    }
+
+  close(fds[1]);
+  bool ok = (read(fds[0], &result, sizeof(result))==sizeof(result));
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+
+  return ( (ok) && (WIFEXITED(status)) && (WEXITSTATUS(status)==EXIT_SUCCESS) );
+}
+
+/* Every engine of the scanner must split text logs as splitStatLine()
+   does. Returns the number of lines that didn't */
+unsigned long verifyScanner(const vector<string> &files)
+{
+  const char *names[] = { "avx2", "sse2", "scalar" };
+  const char *current = KCLineScanner::engine();
+  unsigned long wrong = 0;
+
+  for (unsigned e=0; e<sizeof(names)/sizeof(names[0]); ++e)
+    {
+      unsigned long lines = 0, mismatches = 0;
+
+      if (!KCLineScanner::setEngine(names[e]))
+	continue;
+      for (unsigned i=0; i<files.size(); ++i)
+	{
+	  const char *data;
+	  long long size = file_map(&data, files[i].c_str());
+	  if (size<=0)
+	    continue;
+
+	  string_view buffer(data, size), keysym;
+	  KCLineScanner scanner(buffer);
+	  KCStatLine line;
+	  size_t pos = 0, eol;
+	  int value = 0;
+
+	  if (!isBinarySegment(buffer))
+	    while (pos<buffer.size())
+	      {
+		eol = buffer.find('\n', pos);
+		if (eol==string_view::npos)
+		  eol = buffer.size();
+		string_view expected = buffer.substr(pos, eol-pos);
+		int command = splitStatLine(expected, keysym, value);
+		++lines;
+		if ( (!scanner.next(line)) || (line.line!=expected) || (line.command!=command) ||
+		     ( (command) && (line.value!=value) ) || ( (command==1) && (line.keysym!=keysym) ) )
+		  {
+		    if (mismatches++<10)
+		      cerr << names[e]<<": "<<files[i]<<" line "<<lines<<" \""<<expected<<"\" split wrong" << endl;
+		  }
+		pos = eol+1;
+	      }
+	  file_unmap(data, size);
+	}
+      cerr << "Scanner "<<names[e]<<": "<<lines<<" lines, "<<mismatches<<" split wrong" << endl;
+      wrong+=mismatches;
+    }
+  KCLineScanner::setEngine(current);
+  return wrong;
+}
+
+/* Every report of the data in dir, as "analyze all" writes them */
+static string allReportsOf(const string &dir, bool cache)
+{
+  KCAnalyzer analyzer;
+  string out;
+
+  analyzer.setDataDir(dir);
+  analyzer.setCache(cache);
+  analyzer.setVerbose(false);
+  {
+    KCReport report(REPORT_CSV, out);
+    allReports(analyzer, report, "intervals,keycount,burst,histogram,hourly,daily,weekly,heatmap", true);
+  }
+  return out;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+  return remove(path);
+}
+
+/* Data may be stored in many ways, analysis must not tell them apart:
+   the files are copied to a scratch directory as they are, converted to
+   the other format and compacted into rollups, and every report of each
+   copy (and of a copy read again from its cache) must be the same.
+   Returns the number of copies whose reports weren't */
+unsigned long verifyStorage(const vector<string> &files)
+{
+  char scratch[] = "/tmp/kcverify.XXXXXX";
+  const char *copies[] = { "converted", "compacted", "cached" };
+  string root, plain, expected;
+  unsigned long wrong = 0, skipped;
+
+  if (mkdtemp(scratch)==NULL)
+    criticalError("Can't create a scratch directory");
+  root = scratch;
+  plain = root+"/plain";
+  for (unsigned c=0; c<4; ++c)
+    {
+      string dir = (c)?root+"/"+copies[c-1]:plain;
+      if (createDir(dir.c_str(), 0744)<0)
+	criticalError("Can't create "+dir);
+    }
+
+  for (unsigned i=0; i<files.size(); ++i)
+    {
+      string name = files[i].substr(files[i].rfind('/')+1);
+      string stem = name.substr(0, name.find('.'));
+      const char *data;
+      long long size = file_map(&data, files[i].c_str());
+      if (size<0)
+	continue;
+      string_view buffer(data, size);
+      bool binary = isBinarySegment(buffer);
+
+      for (unsigned c=0; c<4; ++c)
+	{
+	  if ( (c!=1) && (!writeFileSync(((c)?root+"/"+copies[c-1]:plain)+"/"+name, buffer)) )
+	    criticalError("Can't copy "+files[i]);
+	}
+      string converted = root+"/converted/"+stem+((binary)?".log":".kcb");
+      if (convertSegment(files[i].c_str(), converted.c_str(), skipped)<0)
+	{
+	  // Nothing to compare a wrong file with, leave it as it is
+	  cerr << "Can't convert "<<files[i]<<", copied as it is" << endl;
+	  unlink(converted.c_str());
+	  writeFileSync(root+"/converted/"+name, buffer);
+	}
+      file_unmap(data, size);
+    }
+
+  KCCompactor compactor(root+"/compacted");
+  if (compactor.run((numeric_limits<time_t>::max)(), DEFAULT_ROLLUP_SIZE)<0)
+    criticalError("Can't compact "+root+"/compacted");
+
+  expected = allReportsOf(plain, false);
+  allReportsOf(root+"/cached", true);
+  for (unsigned c=0; c<3; ++c)
+    {
+      bool same = (allReportsOf(root+"/"+copies[c], c==2)==expected);
+      cerr << "Storage "<<copies[c]<<": "<<((same)?"same reports":"reports differ") << endl;
+      if (!same)
+	++wrong;
+    }
+
+  nftw(scratch, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  return wrong;
+}
+
+void benchData(int argc, char *argv[])
+{
+  int format = REPORT_JSON;
+  unsigned runs = 3;
+  long long bytes = 0, lines = 0;
+  string value, dir;
+  vector<string> files;
+  KCBenchResult result;
+  bool verify = false;
+  struct dirent *ent;
+  DIR *d;
+
+  if (argc<3)
+    {
+      cerr << "Please tell me what to analyze: "<<endl;
+      cerr << "   "<<argv[0]<<" bench directory [--runs=3] [--format=json] [--scanner=avx2|sse2|scalar] [--verify]"<<endl;
+      cerr << "   Times keycount, burst and hourly end to end, and the log parser alone"<<endl;
+      cerr << "   --verify checks every line scanner against the plain line splitter first, and that"<<endl;
+      cerr << "   converted, compacted and cached copies of the data give the same reports"<<endl;
+      cerr << "   --runs=0 only verifies"<<endl;
+      return;
+    }
+
+  dir = argv[2];
+  for (int i=3; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "runs", value))
+	runs = max(0, atoi(value.c_str()));
+      else if ( (optionValue(arg, "format", value)) && (KCReport::formatFromName(value)>=0) )
+	format = KCReport::formatFromName(value);
+      else if (optionValue(arg, "scanner", value))
+	{
+	  if (!KCLineScanner::setEngine(value))
+	    criticalError("Scanner "+value+" is unknown or this CPU can't run it");
+	}
+      else if (arg=="--verify")
+	verify = true;
+      else
+	criticalError("Unknown option "+arg);
+    }
+
+  d = opendir(dir.c_str());
+  if (d==NULL)
+    criticalError("Can't open "+dir);
+  while ((ent = readdir(d)) != NULL)
+    {
+      if ( (strcmp(ent->d_name, ".")!=0) && (strcmp(ent->d_name, "..")!=0) )
+	files.push_back(dir+"/"+ent->d_name);
+    }
+  closedir(d);
+  sort(files.begin(), files.end(), segmentOrder);
+
+  // Size of the data set, lines are only meaningful for text logs
+  for (unsigned i=0; i<files.size(); ++i)
+    {
+      const char *data;
+      long long size = file_map(&data, files[i].c_str());
+      if (size<=0)
+	continue;
+      bytes+=size;
+      lines+=count(data, data+size, '\n');
+      file_unmap(data, size);
+    }
+
+  if ( (verify) && (verifyScanner(files)) )
+    criticalError("The line scanner doesn't split logs right");
+  if ( (verify) && (verifyStorage(files)) )
+    criticalError("Reports depend on how data is stored");
+  cerr << "Line scanner: "<<KCLineScanner::engine() << endl;
+  if (!runs)
+    return;
+
+  KCReport report(format);
+  report.begin({"benchmark", "runs", "files", "lines", "bytes", "seconds",
+		"lines_per_s", "mb_per_s", "peak_rss_kb"});
+
+  const char *modes[] = { "keycount", "burst", "hourly", "parse", "split", "scan" };
+  for (unsigned m=0; m<sizeof(modes)/sizeof(modes[0]); ++m)
+    {
+      if (!runBenchmark(modes[m], dir, files, runs, result))
+	{
+	  cerr << "Benchmark "<<modes[m]<<" failed"<<endl;
+	  continue;
+	}
+
+      report.field(modes[m]);
+      report.field(runs);
+      report.field((long)files.size());
+      report.field(lines);
+      report.field(bytes);
+      report.field(result.seconds);
+      report.field((long long)(lines/result.seconds));
+      report.field(bytes/result.seconds/1048576.0);
+      report.field(result.rss);
+      report.endRow();
+      report.flush();
+    }
+  report.end();
+}
+
+void convertData(int argc, char *argv[])
+{
+  if (argc<4)
+    {
+      cerr << "Please tell me what to convert: "<<endl;
+      cerr << "   "<<argv[0]<<" convert origin destination - Text log to binary or binary log to text"<<endl;
+      return;
     }
+
+  unsigned long skipped;
+  switch (convertSegment(argv[2], argv[3], skipped))
+    {
+    case -1:
+      criticalError((string)"Can't read "+argv[2]);
+    case -2:
+      criticalError((string)"Can't write "+argv[3]);
+    case -3:
+      criticalError((string)argv[2]+" is corrupt");
+    case -4:
+      criticalError(to_string(skipped)+" wrong lines of "+argv[2]+" were left out of "+argv[3]);
+    }
+}
+
+void compactData(int argc, char *argv[])
+{
+  string dir = dataDirectory("");
+  time_t before = time(NULL)-DEFAULT_COMPACT_AGE;
+  long long rollupBytes = DEFAULT_ROLLUP_SIZE;
+  string value;
+  long rollups;
+
+  for (int i=2; i<argc; ++i)
+    {
+      string arg = argv[i];
+      if (optionValue(arg, "before", value))
+	before = timeValue(value);
+      else if (optionValue(arg, "segment", value))
+	rollupBytes = sizeValue(value);
+      else if (optionValue(arg, "dir", value))
+	dir = value;
+      else if (arg.compare(0, 2, "--")==0)
+	{
+	  cerr << "Unknown option "<<arg<<", try:"<<endl;
+	  cerr << "   "<<argv[0]<<" compact [--dir=directory] [--before=\"YYYY-MM-DD HH:MM\"] [--segment=16Mb]"<<endl;
+	  return;
+	}
+      else
+	dir = arg;		// As older versions took it
+    }
+  if (rollupBytes<=0)
+    criticalError("Wrong rollup size");
+
+  KCCompactor compactor(dir);
+  rollups = compactor.run(before, rollupBytes);
+  if (rollups<0)
+    criticalError("Can't write rollups in "+dir);
+
+  cerr << compactor.sourceFiles() << " segments ("<<compactor.bytesReplaced()<<" bytes) compacted into "
+       << rollups << " rollups ("<<compactor.bytesWritten()<<" bytes)" << endl;
 }
 
 int main(int argc, char *argv[])
@@ -700,11 +4332,36 @@ int main(int argc, char *argv[])
     {
       if ( (string)argv[1]=="analyze" )
 	analyzeData(argc, argv);
+      else if ( (string)argv[1]=="fleet" )
+	fleetData(argc, argv);
+      else if ( (string)argv[1]=="query" )
+	queryData(argc, argv);
+      else if ( (string)argv[1]=="stats" )
+	statsData(argc, argv);
+      else if ( (string)argv[1]=="merge" )
+	mergeData(argc, argv);
+      else if ( (string)argv[1]=="summary" )
+	summaryData(argc, argv);
+      else if ( (string)argv[1]=="record" )
+	recordData(argc, argv);
+      else if ( (string)argv[1]=="replay" )
+	replayData(argc, argv);
+      else if ( (string)argv[1]=="convert" )
+	convertData(argc, argv);
+      else if ( (string)argv[1]=="compact" )
+	compactData(argc, argv);
+      else if ( (string)argv[1]=="generate" )
+	generateData(argc, argv);
+      else if ( (string)argv[1]=="bench" )
+	benchData(argc, argv);
       else
-	criticalError("Unrecognised command, try 'analyze' or no command");
+	criticalError("Unrecognised command, try 'analyze', 'query', 'stats', 'fleet', 'merge', 'summary', 'record', 'replay', 'convert', 'compact', 'generate', 'bench' or no command");
     }
   else
-    captureKeys();
+    {
+      GXRecordSource source;
+      captureKeys(source);
+    }
 
   return EXIT_SUCCESS;
 }